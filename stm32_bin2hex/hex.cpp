@@ -1,55 +1,623 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hex.h"
 
-static char hextoint(char c)
+const char hexUtils::hexDigits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+};
+
+/* value of a hex digit, 0xFF for anything else */
+const uint8_t hexUtils::hexNibble[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+uint32_t hexUtils::encodeHexRecord(uint8_t recordType, uint16_t loadOffset, const uint8_t* data, uint8_t recordLen, char* buffer)
+{
+    char* p = buffer;
+    uint8_t sum = recordLen + (loadOffset >> 8) + (loadOffset & 0xFF) + recordType;
+
+    *p++ = ':';
+    p = putHexByte(p, recordLen);
+    p = putHexByte(p, loadOffset >> 8);
+    p = putHexByte(p, loadOffset & 0xFF);
+    p = putHexByte(p, recordType);
+    sum += encodeHexBytes(data, recordLen, p);
+    p += recordLen * 2;
+    p = putHexByte(p, (uint8_t)(~sum + 1));
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buffer;
+}
+
+uint32_t hexUtils::hexDataBlockSize(uint32_t dataLen, uint8_t recordLen)
 {
-    if('0' <= c && c <= '9') {
-        return c - '0';
+    if(!recordLen) {
+        return 0;
     }
-    if('a' <= c && c <= 'f') {
-        return c - 'a' + 10;
+    uint32_t records = dataLen / recordLen;
+    uint32_t size = records * HEX_RECORD_TEXT_LEN(recordLen);
+    if(dataLen % recordLen) {
+        size += HEX_RECORD_TEXT_LEN(dataLen % recordLen);
     }
-    if('A' <= c && c <= 'F') {
-        return c - 'A' + 10;
+    return size;
+}
+
+uint32_t hexUtils::encodeHexDataBlock(uint16_t loadOffset, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, char* buffer, uint32_t bufferLen)
+{
+    if(!data || !buffer || !recordLen) {
+        return 0;
     }
-    return 0;
+    if(hexDataBlockSize(dataLen, recordLen) > bufferLen) {
+        return 0;
+    }
+    uint32_t n = 0;
+    while(dataLen) {
+        uint8_t len = dataLen < recordLen ? dataLen : recordLen;
+        n += encodeHexRecord(HEX_RECORD_DATA, loadOffset, data, len, &buffer[n]);
+        loadOffset += len;
+        data += len;
+        dataLen -= len;
+    }
+    return n;
+}
+
+uint32_t hexUtils::hexSegmentSize(uint32_t dataLen, uint8_t recordLen, bool extRecord)
+{
+    return hexDataBlockSize(dataLen, recordLen) + (extRecord ? HEX_EXT_RECORD_TEXT_LEN : 0);
+}
+
+uint32_t hexUtils::encodeHexSegment(uint32_t address, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, bool extRecord, char* buffer)
+{
+    uint32_t n = 0;
+    if(extRecord) {
+        uint8_t ext[2] = { (uint8_t)(address >> 24), (uint8_t)(address >> 16) };
+        n += encodeHexRecord(HEX_RECORD_EXT_LINE_SEG_ADDR, 0, ext, sizeof(ext), buffer);
+    }
+    n += encodeHexDataBlock(address & 0xFFFF, data, dataLen, recordLen, &buffer[n], hexDataBlockSize(dataLen, recordLen));
+    return n;
 }
 
-static uint8_t hexCheckSum(const char* data, uint32_t len)
+uint32_t hexUtils::encodeEndOfFile(uint8_t format, bool startValid, uint32_t startAddress, char* buffer)
 {
-    int8_t bRet = 0;
+    uint32_t n = 0;
+    if(format != HEX_FORMAT_IHEX) {
+        return encodeSRecord(10 - format, startValid ? startAddress : 0, NULL, 0, buffer);
+    }
+    if(startValid) {
+        uint8_t start[4] = { (uint8_t)(startAddress >> 24), (uint8_t)(startAddress >> 16), (uint8_t)(startAddress >> 8), (uint8_t)startAddress };
+        n += encodeHexRecord(HEX_RECORD_ST_LINE_SEG_ADDR, 0, start, sizeof(start), buffer);
+    }
+    n += encodeHexRecord(HEX_RECORD_ENDOFFILE, 0, NULL, 0, &buffer[n]);
+    return n;
+}
+int32_t hexUtils::parseFileAddress(char* arg, bool* hasAddress, uint32_t* address)
+{
+    char* at = strrchr(arg, '@');
+    char* end = NULL;
+    *hasAddress = false;
+    *address = 0;
+    if(!at) {
+        return 0;
+    }
+    unsigned long value = strtoul(at + 1, &end, 16);
+    if(at[1] == '\0' || *end != '\0' || value > 0xFFFFFFFFUL) {
+        return -1;
+    }
+    *at = '\0';
+    *address = value;
+    *hasAddress = true;
+    return 0;
+}
+int32_t hexUtils::decodeHexRecord(const char* text, uint32_t len, struct hex_data_t* hex, uint32_t* errorOffset)
+{
+    uint8_t head[4];
+    uint8_t sum = 0;
+    uint32_t n;
 
-    #define TI2(h) (hextoint(data[h]) << 4 | hextoint(data[h + 1]))
-    bRet += TI2(0);
-    bRet += TI2(2);
-    bRet += TI2(4);
-    bRet += TI2(6);
-    
-    for(uint32_t i = 0, j = 0; i < len; i++) {
-        bRet += TI2(j + 8);
-        j += 2;
-        
+    if(len < HEX_RECORD_TEXT_LEN(0) - 2 || text[0] != ':') {
+        return HEX_DECODE_MALFORMED;
+    }
+    n = decodeHexBytes(&text[1], sizeof(head), head, &sum);
+    if(n != sizeof(head) * 2) {
+        if(errorOffset) {
+            *errorOffset = 1 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
     }
-    bRet = ~bRet + 1;
-    return bRet;
+    hex->recordLen  = head[0];
+    hex->loadOffset = head[1] << 8 | head[2];
+    hex->recordType = head[3];
+    if(HEX_RECORD_TEXT_LEN(hex->recordLen) - 2U != len) {
+        return HEX_DECODE_MALFORMED;
+    }
+    /* data and checksum in one go, data[] has room for the extra byte */
+    n = decodeHexBytes(&text[9], hex->recordLen + 1, hex->data, &sum);
+    if(n != (hex->recordLen + 1U) * 2) {
+        if(errorOffset) {
+            *errorOffset = 9 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
+    }
+    hex->chksum = hex->data[hex->recordLen];
+    return sum == 0 ? HEX_DECODE_OK : HEX_DECODE_CHECKSUM;
 }
+int32_t hexUtils::decodeHexHeader(const char* text, uint32_t len, struct hex_data_t* hex, uint32_t* errorOffset)
+{
+    uint8_t head[4];
+    uint8_t sum = 0;
+    uint32_t n;
 
+    if(len < HEX_RECORD_TEXT_LEN(0) - 2 || text[0] != ':') {
+        return HEX_DECODE_MALFORMED;
+    }
+    n = decodeHexBytes(&text[1], sizeof(head), head, &sum);
+    if(n != sizeof(head) * 2) {
+        if(errorOffset) {
+            *errorOffset = 1 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
+    }
+    hex->recordLen  = head[0];
+    hex->loadOffset = head[1] << 8 | head[2];
+    hex->recordType = head[3];
+    if(HEX_RECORD_TEXT_LEN(hex->recordLen) - 2U != len) {
+        return HEX_DECODE_MALFORMED;
+    }
+    return HEX_DECODE_OK;
+}
 bool hexUtils::encodeHexData(const struct hex_data_t* hex, char* buffer, uint32_t len)
 {
     if(!hex || !buffer || !len) {
         return false;
     }
-    uint32_t n = 0;
     memset(buffer, 0, len);
-    if((16 + hex->recordLen * 2) > len) {
+    if((16U + hex->recordLen * 2) > len) {
+        return false;
+    }
+    encodeHexRecord(hex->recordType, hex->loadOffset, hex->data, hex->recordLen, buffer);
+    return true;
+}
+
+hexWriter::hexWriter(FILE* fp, uint32_t bufferSize)
+    : m_fp(fp), m_buffer(NULL), m_size(bufferSize), m_used(0), m_error(false),
+      m_format(hexUtils::HEX_FORMAT_IHEX), m_recordLen(hexUtils::HEX_RECORD_DEFAULT_LEN), m_extValid(false), m_extAddress(0),
+      m_startValid(false), m_startAddress(0), m_pendingAddress(0), m_pendingLen(0)
+{
+    m_buffer = (char *)malloc(m_size);
+}
+
+hexWriter::~hexWriter()
+{
+    flush();
+    free(m_buffer);
+}
+
+char* hexWriter::reserve(uint32_t len)
+{
+    if(!m_buffer || len > m_size) {
+        return NULL;
+    }
+    if(m_size - m_used < len && !flush()) {
+        return NULL;
+    }
+    return &m_buffer[m_used];
+}
+
+bool hexWriter::write(const char* data, uint32_t len)
+{
+    /* raw text may carry its own records, so forget the address state */
+    if(!flushRecord()) {
+        return false;
+    }
+    m_extValid = false;
+    while(len) {
+        uint32_t n = len < m_size ? len : m_size;
+        char* p = reserve(n);
+        if(!p) {
+            return false;
+        }
+        memcpy(p, data, n);
+        commit(n);
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool hexWriter::flush(void)
+{
+    if(m_error || !m_fp) {
+        return false;
+    }
+    if(m_used && fwrite(m_buffer, 1, m_used, m_fp) != m_used) {
+        m_error = true;
+        return false;
+    }
+    m_used = 0;
+    return true;
+}
+
+bool hexWriter::setFormat(uint8_t format)
+{
+    if(format > hexUtils::HEX_FORMAT_S37 || m_recordLen > hexUtils::maxRecordLen(format)) {
+        return false;
+    }
+    if(!flushRecord()) {
+        return false;
+    }
+    m_format = format;
+    m_extValid = false;
+    return true;
+}
+
+bool hexWriter::setRecordLen(uint32_t recordLen)
+{
+    if(recordLen == 0 || recordLen > hexUtils::maxRecordLen(m_format)) {
+        return false;
+    }
+    if(!flushRecord()) {
+        return false;
+    }
+    m_recordLen = recordLen;
+    return true;
+}
+
+bool hexWriter::writeRecord(uint8_t recordType, uint16_t loadOffset, const uint8_t* data, uint8_t len)
+{
+    char* p = reserve(HEX_RECORD_TEXT_LEN(len));
+    if(!p) {
+        return false;
+    }
+    commit(hexUtils::encodeHexRecord(recordType, loadOffset, data, len, p));
+    return true;
+}
+
+bool hexWriter::writeSRecord(uint8_t recordType, uint32_t address, const uint8_t* data, uint8_t len)
+{
+    char* p = reserve(SREC_RECORD_TEXT_LEN(hexUtils::sRecordAddressLen(recordType), len));
+    if(!p) {
+        return false;
+    }
+    commit(hexUtils::encodeSRecord(recordType, address, data, len, p));
+    return true;
+}
+
+bool hexWriter::writeExtAddress(uint32_t address)
+{
+    uint16_t upper = address >> 16;
+    if(m_extValid && m_extAddress == upper) {
+        return true;
+    }
+    uint8_t ext[2] = { (uint8_t)(upper >> 8), (uint8_t)(upper & 0xFF) };
+    if(!writeRecord(hexUtils::HEX_RECORD_EXT_LINE_SEG_ADDR, 0, ext, sizeof(ext))) {
+        return false;
+    }
+    m_extValid = true;
+    m_extAddress = upper;
+    return true;
+}
+
+bool hexWriter::flushRecord(void)
+{
+    if(!m_pendingLen) {
+        return true;
+    }
+    if(m_format != hexUtils::HEX_FORMAT_IHEX) {
+        if(!writeSRecord(m_format, m_pendingAddress, m_pending, m_pendingLen)) {
+            return false;
+        }
+        m_pendingLen = 0;
+        return true;
+    }
+    if(!writeExtAddress(m_pendingAddress)) {
+        return false;
+    }
+    if(!writeRecord(hexUtils::HEX_RECORD_DATA, m_pendingAddress & 0xFFFF, m_pending, m_pendingLen)) {
+        return false;
+    }
+    m_pendingLen = 0;
+    return true;
+}
+
+bool hexWriter::writeData(uint32_t address, const uint8_t* data, uint32_t len)
+{
+    /* S19 and S28 cut the address to 16 and 24 bits, refuse instead */
+    if(len && (uint64_t)address + len - 1 > hexUtils::maxAddress(m_format)) {
+        return false;
+    }
+    if(m_pendingLen && address != m_pendingAddress + m_pendingLen) {
+        if(!flushRecord()) {
+            return false;
+        }
+    }
+    while(len) {
+        /* Intel HEX blocks end at the segment, S-record blocks just bound the buffer use */
+        uint32_t segmentLeft = hexUtils::HEX_SEGMENT_SIZE - (address & 0xFFFF);
+        uint32_t n;
+        if(m_format != hexUtils::HEX_FORMAT_IHEX) {
+            segmentLeft = m_recordLen * HEX_WRITER_BLOCK_RECORDS;
+        }
+        if(m_pendingLen) {
+            /* top up the record a previous call left open */
+            n = m_recordLen - m_pendingLen;
+            n = n < segmentLeft ? n : segmentLeft;
+            n = n < len ? n : len;
+            memcpy(&m_pending[m_pendingLen], data, n);
+            m_pendingLen += n;
+            if((m_pendingLen == m_recordLen || n == segmentLeft) && !flushRecord()) {
+                return false;
+            }
+        } else {
+            /* whole records up to the segment end go out in one block */
+            n = len < segmentLeft ? len : segmentLeft;
+            uint32_t whole = (n == segmentLeft) ? n : n - n % m_recordLen;
+            if(whole && m_format != hexUtils::HEX_FORMAT_IHEX) {
+                char* p = reserve(hexUtils::sRecordBlockSize(m_format, whole, m_recordLen));
+                if(!p) {
+                    return false;
+                }
+                commit(hexUtils::encodeSRecordBlock(m_format, address, data, whole, m_recordLen, p));
+            } else if(whole) {
+                if(!writeExtAddress(address)) {
+                    return false;
+                }
+                uint32_t size = hexUtils::hexDataBlockSize(whole, m_recordLen);
+                char* p = reserve(size);
+                if(!p) {
+                    return false;
+                }
+                commit(hexUtils::encodeHexDataBlock(address & 0xFFFF, data, whole, m_recordLen, p, size));
+            }
+            if(n != whole) {
+                m_pendingAddress = address + whole;
+                m_pendingLen = n - whole;
+                memcpy(m_pending, &data[whole], m_pendingLen);
+            }
+        }
+        address += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool hexWriter::writeHeader(void)
+{
+    if(m_format == hexUtils::HEX_FORMAT_IHEX) {
+        return true;
+    }
+    return writeSRecord(0, 0, NULL, 0);
+}
+
+bool hexWriter::writeEndOfFile(void)
+{
+    if(m_startValid && m_startAddress > hexUtils::maxAddress(m_format)) {
+        return false;
+    }
+    if(!flushRecord()) {
+        return false;
+    }
+    char* p = reserve(HEX_RECORD_TEXT_LEN(4) + HEX_RECORD_TEXT_LEN(0));
+    if(!p) {
+        return false;
+    }
+    commit(hexUtils::encodeEndOfFile(m_format, m_startValid, m_startAddress, p));
+    return true;
+}
+
+hexReader::hexReader()
+    : m_map(NULL), m_mapLen(0), m_buffer(NULL), m_pos(0), m_end(0), m_line(1), m_trustLength(false), m_dropConsumed(false), m_dropped(0)
+{
+}
+
+hexReader::~hexReader()
+{
+    close();
+}
+
+bool hexReader::open(const char* fileName)
+{
+    struct stat sbuf;
+    int fd;
+    close();
+    fd = ::open(fileName, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    if(fstat(fd, &sbuf) < 0 || sbuf.st_size == 0 || sbuf.st_size > 0xFFFFFFFFLL) {
+        ::close(fd);
         return false;
     }
-    n = snprintf(buffer, len, ":%02X%04X%02X", hex->recordLen, hex->loadOffset, hex->recordType);
-    for(uint32_t i = 0; i < hex->recordLen; i++) {
-        n += snprintf(&buffer[n], len - n, "%02X", hex->data[i]);
+    void* map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED) {
+        return false;
     }
-    snprintf(&buffer[n], len - n, "%02X\r\n", hexCheckSum(&buffer[1], n - 1));
+    madvise(map, sbuf.st_size, MADV_SEQUENTIAL);
+    m_map = (uint8_t *)map;
+    m_mapLen = sbuf.st_size;
+    assign(m_map, 0, m_mapLen);
     return true;
 }
+
+void hexReader::close(void)
+{
+    if(m_map) {
+        munmap(m_map, m_mapLen);
+    }
+    m_map = NULL;
+    m_mapLen = 0;
+    assign(NULL, 0, 0);
+}
+
+void hexReader::assign(const uint8_t* buffer, uint32_t begin, uint32_t end, uint32_t line)
+{
+    m_buffer = buffer;
+    m_dropped = 0;
+    m_pos = begin;
+    m_end = end;
+    m_line = line;
+}
+
+bool hexReader::next(record_t* record)
+{
+    while(m_pos < m_end) {
+        const uint8_t* text = &m_buffer[m_pos];
+        const uint8_t* lf = NULL;
+        uint32_t avail = m_end - m_pos;
+        uint32_t expect = avail;
+        if(m_trustLength && avail >= 4 && (text[0] == ':' || text[0] == 'S')) {
+            uint8_t hi = hexUtils::hexNibble[(uint8_t)text[text[0] == ':' ? 1 : 2]];
+            uint8_t lo = hexUtils::hexNibble[(uint8_t)text[text[0] == ':' ? 2 : 3]];
+            if(hi < 16 && lo < 16) {
+                expect = text[0] == ':' ? 11 + 2 * (hi << 4 | lo) : 4 + 2 * (hi << 4 | lo);
+            }
+        }
+        if(expect < avail && text[expect] == 0x0A) {
+            lf = &text[expect];
+        } else if(expect + 1 < avail && text[expect] == 0x0D && text[expect + 1] == 0x0A) {
+            lf = &text[expect + 1];
+        } else {
+            lf = (const uint8_t *)memchr(text, 0x0A, avail);
+        }
+        uint32_t len = lf ? lf - text : avail;
+        uint32_t line = m_line;
+        m_pos += len + (lf ? 1 : 0);
+        m_line++;
+        if(len && text[len - 1] == 0x0D) {
+            len--;
+        }
+        /* the mark is the first non-blank character of a record line, anything else is a comment */
+        uint32_t mark = 0;
+        while(mark < len && (text[mark] == ' ' || text[mark] == '\t')) {
+            mark++;
+        }
+        if(mark == len) {
+            continue;
+        }
+        if(text[mark] != ':' && (text[mark] != 'S' || mark + 1 == len || text[mark + 1] < '0' || text[mark + 1] > '9')) {
+            continue;
+        }
+        if(m_dropConsumed && m_map && m_buffer == m_map && m_pos - m_dropped >= HEX_READER_DROP_SIZE) {
+            /* whole blocks before the current line only, it is still being handed out */
+            uint32_t upto = (text - m_map) & ~(HEX_READER_DROP_SIZE - 1);
+            if(upto > m_dropped) {
+                madvise(m_map + m_dropped, upto - m_dropped, MADV_DONTNEED);
+                m_dropped = upto;
+            }
+        }
+        record->text = &text[mark];
+        record->len = len - mark;
+        record->offset = &text[mark] - m_buffer;
+        record->line = line;
+        return true;
+    }
+    return false;
+}
+
+int32_t hexReader::walk(walk_t* state, walkHandler_t handler, void* context)
+{
+    struct hexUtils::hex_data_t hex;
+    struct hexUtils::srec_data_t srec;
+    walk_data_t d;
+    record_t record;
+    state->error = hexUtils::HEX_DECODE_OK;
+    while(!state->ended && next(&record)) {
+        const char* text = (const char *)record.text;
+        uint32_t errorOffset = 0;
+        int32_t bRet;
+        d.record = &record;
+        d.len = 0;
+        if(text[0] == 'S') {
+            bRet = hexUtils::decodeSRecord(text, record.len, &srec, &errorOffset);
+            if(bRet == hexUtils::HEX_DECODE_OK && 1 <= srec.recordType && srec.recordType <= 3) {
+                d.address = srec.address;
+                d.data = srec.data;
+                d.len = srec.recordLen;
+                d.loadOffset = 0;
+                d.type = srec.recordType;
+            } else if(bRet == hexUtils::HEX_DECODE_OK && 7 <= srec.recordType && srec.recordType <= 9) {
+                state->startValid = true;
+                state->startAddress = srec.address;
+            }
+        } else {
+            bRet = hexUtils::decodeHexRecord(text, record.len, &hex, &errorOffset);
+            if(bRet == hexUtils::HEX_DECODE_OK) {
+                switch(hex.recordType) {
+                    case hexUtils::HEX_RECORD_DATA:
+                        d.address = state->base + hex.loadOffset;
+                        d.data = hex.data;
+                        d.len = hex.recordLen;
+                        d.loadOffset = hex.loadOffset;
+                        d.type = 0;
+                        break;
+                    case hexUtils::HEX_RECORD_ENDOFFILE:
+                        state->ended = true;
+                        break;
+                    case hexUtils::HEX_RECORD_EXT_SEG_ADDR:
+                        state->base = (hex.data[0] << 8 | hex.data[1]) << 4;
+                        break;
+                    case hexUtils::HEX_RECORD_EXT_LINE_SEG_ADDR:
+                        state->base = (hex.data[0] << 8 | hex.data[1]) << 16;
+                        break;
+                    case hexUtils::HEX_RECORD_ST_LINE_SEG_ADDR:
+                        if(hex.recordLen != 4) {
+                            break;
+                        }
+                        state->startValid = true;
+                        state->startAddress = (uint32_t)hex.data[0] << 24 | hex.data[1] << 16 | hex.data[2] << 8 | hex.data[3];
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+        if(bRet != hexUtils::HEX_DECODE_OK) {
+            state->error = bRet;
+            state->errorOffset = errorOffset;
+            state->record = record;
+            return -1;
+        }
+        if(d.len) {
+            bRet = handler(context, &d);
+            if(bRet) {
+                return bRet;
+            }
+        }
+    }
+    return 0;
+}
+
+const char* hexReader::walkError(const walk_t* state, char* buffer, uint32_t size)
+{
+    const record_t* r = &state->record;
+    if(state->error == hexUtils::HEX_DECODE_BAD_DIGIT) {
+        snprintf(buffer, size, "invalid character 0x%02x at line %u, column %u", r->text[state->errorOffset], r->line, state->errorOffset + 1);
+    } else if(state->error == hexUtils::HEX_DECODE_CHECKSUM) {
+        snprintf(buffer, size, "checksum error at line %u", r->line);
+    } else {
+        snprintf(buffer, size, "malformed record at line %u", r->line);
+    }
+    return buffer;
+}
@@ -2,7 +2,12 @@
 #define __STM32_BIN2HEX_H__
 
 #include <cstdint>
+#include <cstdio>
 
+/* record text lengths with CRLF: n data bytes, a address bytes for S-records */
+#define HEX_RECORD_TEXT_LEN(n)  (13 + (n) * 2)
+#define HEX_EXT_RECORD_TEXT_LEN HEX_RECORD_TEXT_LEN(2)
+#define SREC_RECORD_TEXT_LEN(a, n)  (8 + (a) * 2 + (n) * 2)
 
 class hexUtils
 {
@@ -15,13 +20,292 @@ public:
         HEX_RECORD_EXT_LINE_SEG_ADDR    = 0x04,
         HEX_RECORD_ST_LINE_SEG_ADDR     = 0x05,
     };
+    enum {
+        HEX_RECORD_DEFAULT_LEN          = 16,
+        HEX_RECORD_MIN_LEN              = 16,
+        HEX_RECORD_MAX_LEN              = 255,
+    };
+    enum {
+        HEX_SEGMENT_SIZE                = 0x10000,
+    };
+    /* decodeHexRecord/decodeSRecord results */
+    enum {
+        HEX_DECODE_OK                   = 0,
+        HEX_DECODE_MALFORMED            = -1,
+        HEX_DECODE_CHECKSUM             = -2,
+        HEX_DECODE_BAD_DIGIT            = -3,
+    };
+    /* output formats, the S-record ones equal their data record type */
+    enum {
+        HEX_FORMAT_IHEX                 = 0,
+        HEX_FORMAT_S19                  = 1,
+        HEX_FORMAT_S28                  = 2,
+        HEX_FORMAT_S37                  = 3,
+    };
     struct hex_data_t {
         uint8_t recordLen;
         uint16_t loadOffset;
         uint8_t  recordType;
         uint8_t  data[256];
+        uint8_t  chksum;
     };
+    struct srec_data_t {
+        uint8_t  recordType;
+        uint8_t  recordLen;
+        uint32_t address;
+        uint8_t  data[256];
+        uint8_t  chksum;
+    };
+    /* value of each character as a hex digit, 0xFF if it is none */
+    static const uint8_t hexNibble[256];
+    /* upper case digit for each nibble */
+    static const char hexDigits[16];
+    /* two digits of v at p, returns the position after them */
+    static char* putHexByte(char* p, uint8_t v)
+    {
+        p[0] = hexDigits[v >> 4];
+        p[1] = hexDigits[v & 0x0F];
+        return p + 2;
+    }
     static bool encodeHexData(const struct hex_data_t*, char* , uint32_t);
+    /*
+     * decode one ":LLAAAATT<data>CC" record of len characters (line end
+     * excluded) in a single pass, checksum included. returns a
+     * HEX_DECODE_* value, for HEX_DECODE_BAD_DIGIT the offset of the first
+     * offending character in the record goes to errorOffset.
+     */
+    static int32_t decodeHexRecord(const char* text, uint32_t len, struct hex_data_t* hex, uint32_t* errorOffset = NULL);
+    /*
+     * length, load offset and type of a record only. the record length is
+     * checked against len, data and checksum are not looked at.
+     */
+    static int32_t decodeHexHeader(const char* text, uint32_t len, struct hex_data_t* hex, uint32_t* errorOffset = NULL);
+    /*
+     * encode one record, ":LLAAAATT<data>CC\r\n", no '\0' appended.
+     * returns the number of characters written (13 + 2 * recordLen).
+     */
+    static uint32_t encodeHexRecord(uint8_t recordType, uint16_t loadOffset, const uint8_t* data, uint8_t recordLen, char* buffer);
+    /* size of the text encodeHexDataBlock produces for dataLen bytes */
+    static uint32_t hexDataBlockSize(uint32_t dataLen, uint8_t recordLen);
+    /*
+     * encode a whole binary range as consecutive data records of recordLen
+     * bytes (the last one may be shorter), loadOffset wraps at 64K.
+     * returns the number of characters written, 0 if buffer is too small.
+     */
+    static uint32_t encodeHexDataBlock(uint16_t loadOffset, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, char* buffer, uint32_t bufferLen);
+    /* size of the text encodeHexSegment produces */
+    static uint32_t hexSegmentSize(uint32_t dataLen, uint8_t recordLen, bool extRecord);
+    /*
+     * encode data that lies inside one 64K segment, starting at address,
+     * optionally preceded by the type-04 record selecting that segment.
+     * returns the number of characters written.
+     */
+    static uint32_t encodeHexSegment(uint32_t address, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, bool extRecord, char* buffer);
+    /*
+     * expand len bytes into 2 * len hex digits and return their 8-bit sum,
+     * runs the widest SIMD kernel the cpu supports (hex_simd.cpp).
+     */
+    static uint8_t encodeHexBytes(const uint8_t* data, uint32_t len, char* buffer);
+    /*
+     * 2 * len hex digits into len bytes with their 8-bit sum added to *sum,
+     * SIMD like encodeHexBytes. returns the offset of the first character
+     * that is no hex digit, 2 * len if they all are.
+     */
+    static uint32_t decodeHexBytes(const char* text, uint32_t len, uint8_t* data, uint8_t* sum);
+    /* number of leading bytes equal to value */
+    static uint32_t spanByte(const uint8_t* data, uint32_t len, uint8_t value);
+    /* number of leading bytes where a and b agree, or where they differ */
+    static uint32_t spanEqual(const uint8_t* a, const uint8_t* b, uint32_t len);
+    static uint32_t spanDiffer(const uint8_t* a, const uint8_t* b, uint32_t len);
+    /*
+     * offset of the first run of fill bytes that is at least minRun long or
+     * reaches the end of the buffer (and may continue in the next one),
+     * its length in runLen. returns len with runLen 0 if there is none.
+     */
+    static uint32_t findFillRun(const uint8_t* data, uint32_t len, uint8_t fill, uint32_t minRun, uint32_t* runLen);
+    static const char* simdKernelName(void);
+
+    /* S-record backend (srec.cpp) */
+    static uint8_t sRecordAddressLen(uint8_t recordType);
+    /* widest data record the format can carry */
+    static uint32_t maxRecordLen(uint8_t format);
+    /* highest address the format can carry, 0xFFFF for S19, 0xFFFFFF for S28 */
+    static uint32_t maxAddress(uint8_t format);
+    static uint32_t encodeSRecord(uint8_t recordType, uint32_t address, const uint8_t* data, uint8_t recordLen, char* buffer);
+    static uint32_t sRecordBlockSize(uint8_t format, uint32_t dataLen, uint8_t recordLen);
+    /* nothing is written and 0 returned if the block runs past maxAddress(format) */
+    static uint32_t encodeSRecordBlock(uint8_t format, uint32_t address, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, char* buffer);
+    /* decode one "S..." record of len characters, same results as decodeHexRecord */
+    static int32_t decodeSRecord(const char* text, uint32_t len, struct srec_data_t* srec, uint32_t* errorOffset = NULL);
+    /* type, address and data length of an S-record, like decodeHexHeader */
+    static int32_t decodeSRecordHeader(const char* text, uint32_t len, struct srec_data_t* srec, uint32_t* errorOffset = NULL);
+    /*
+     * closing records of a file in format: optional start address (type 05
+     * or the termination address) and end of file. returns the length.
+     */
+    static uint32_t encodeEndOfFile(uint8_t format, bool startValid, uint32_t startAddress, char* buffer);
+    /*
+     * "file@address" names a raw binary placed at a hex address: the '@'
+     * is cut off arg and hasAddress set. a plain name leaves hasAddress
+     * false, -1 and arg untouched if the address does not parse.
+     */
+    static int32_t parseFileAddress(char* arg, bool* hasAddress, uint32_t* address);
+};
+
+/*
+ * large reusable output buffer in front of a FILE, encoders reserve space
+ * in it, write the text in place and commit; the buffer only goes to the
+ * file when it is full, so output costs one fwrite per buffer.
+ *
+ * writeData() lays data out as records on top of it: a record starts at
+ * the beginning of every contiguous run and every recordLen bytes after.
+ * in Intel HEX a record never crosses a 64K segment and a type-04 record
+ * is emitted whenever the upper 16 address bits change; S-records carry
+ * the full address and need neither. consecutive calls with contiguous
+ * addresses give the same records as one call with all the data.
+ */
+class hexWriter
+{
+public:
+    enum {
+        HEX_WRITER_BUFFER_SIZE   = 1024 * 1024,
+        HEX_WRITER_BLOCK_RECORDS = 1024,
+    };
+    hexWriter(FILE* fp, uint32_t bufferSize = HEX_WRITER_BUFFER_SIZE);
+    ~hexWriter();
+    bool valid(void) const { return m_buffer != NULL; }
+    bool error(void) const { return m_error; }
+    /* pointer to len free bytes, NULL if len does not fit the buffer */
+    char* reserve(uint32_t len);
+    void commit(uint32_t len) { m_used += len; }
+    bool write(const char* data, uint32_t len);
+    bool flush(void);
+
+    bool setFormat(uint8_t format);
+    uint8_t format(void) const { return m_format; }
+    bool setRecordLen(uint32_t recordLen);
+    uint8_t recordLen(void) const { return m_recordLen; }
+    /* S0 header for S-records, nothing for Intel HEX */
+    bool writeHeader(void);
+    bool writeData(uint32_t address, const uint8_t* data, uint32_t len);
+    /*
+     * entry point written with the end of file: a type-05 record before
+     * it in Intel HEX, the address of the S7/S8/S9 termination record.
+     */
+    void setStartAddress(uint32_t address) { m_startValid = true; m_startAddress = address; }
+    /* end of file record, S7/S8/S9 termination for S-records */
+    bool writeEndOfFile(void);
+private:
+    hexWriter(const hexWriter&);
+    hexWriter& operator=(const hexWriter&);
+    bool writeRecord(uint8_t recordType, uint16_t loadOffset, const uint8_t* data, uint8_t len);
+    bool writeSRecord(uint8_t recordType, uint32_t address, const uint8_t* data, uint8_t len);
+    bool writeExtAddress(uint32_t address);
+    bool flushRecord(void);
+    FILE*    m_fp;
+    char*    m_buffer;
+    uint32_t m_size;
+    uint32_t m_used;
+    bool     m_error;
+    uint8_t  m_format;
+    uint8_t  m_recordLen;
+    bool     m_extValid;
+    uint16_t m_extAddress;
+    bool     m_startValid;
+    uint32_t m_startAddress;
+    uint32_t m_pendingAddress;
+    uint32_t m_pendingLen;
+    uint8_t  m_pending[256];
+};
+
+/*
+ * record tokenizer over a read-only mapping of the input. lines end in LF
+ * or CRLF and are found with memchr, a record is handed out as a span
+ * into the mapping starting at its ':' or 'S' mark, line end excluded.
+ * lines that do not start with ':' or 'S' and a digit after optional
+ * blanks are skipped, so comments and trailers pass. assign() tokenizes a slice of
+ * a buffer mapped elsewhere, e.g. one part of a file split across threads.
+ */
+class hexReader
+{
+public:
+    enum {
+        HEX_READER_DROP_SIZE = 1024 * 1024,
+    };
+    struct record_t {
+        const uint8_t* text;
+        uint32_t len;
+        /* of text from the start of the buffer, and 1-based line number */
+        uint32_t offset;
+        uint32_t line;
+    };
+    hexReader();
+    ~hexReader();
+    /* false if the file can't be opened or mapped, or is empty */
+    bool open(const char* fileName);
+    void close(void);
+    void assign(const uint8_t* buffer, uint32_t begin, uint32_t end, uint32_t line = 1);
+    const uint8_t* data(void) const { return m_buffer; }
+    uint32_t size(void) const { return m_mapLen; }
+    bool next(record_t* record);
+    /*
+     * find the line end from the record's length field instead of scanning
+     * the payload, when a line end is where the length says. for summaries
+     * only: a length that is wrong by whole lines merges them.
+     */
+    void trustLength(bool trust) { m_trustLength = trust; }
+    /*
+     * give the pages of an opened file back once read past, so a file
+     * streamed once costs no more resident memory than the read window.
+     */
+    void dropConsumed(bool drop) { m_dropConsumed = drop; }
+
+    /*
+     * state of walk() across calls, zero it to start: the type-02/04 base,
+     * the start address (type 05 or S7/S8/S9) and the record that stopped
+     * the walk with its HEX_DECODE_* error.
+     */
+    struct walk_t {
+        uint32_t base;
+        bool     startValid;
+        uint32_t startAddress;
+        bool     ended;
+        int32_t  error;
+        uint32_t errorOffset;
+        record_t record;
+    };
+    /* data record at its absolute address, type 0 for Intel HEX, the S-record type else */
+    struct walk_data_t {
+        const record_t* record;
+        uint32_t address;
+        const uint8_t* data;
+        uint32_t len;
+        uint16_t loadOffset;
+        uint8_t  type;
+    };
+    typedef int32_t (*walkHandler_t)(void* context, const walk_data_t* data);
+    /*
+     * decode the records from where the reader stands up to the end of
+     * file record and hand every data record with data to handler. returns
+     * 0 at the end, the handler's value when it is not 0, -1 with
+     * state->error set at a record that does not decode; a later call goes
+     * on after it.
+     */
+    int32_t walk(walk_t* state, walkHandler_t handler, void* context);
+    /* the record that stopped walk(), "checksum error at line 3" and the like */
+    static const char* walkError(const walk_t* state, char* buffer, uint32_t size);
+private:
+    hexReader(const hexReader&);
+    hexReader& operator=(const hexReader&);
+    uint8_t* m_map;
+    uint32_t m_mapLen;
+    const uint8_t* m_buffer;
+    uint32_t m_pos;
+    uint32_t m_end;
+    uint32_t m_line;
+    bool     m_trustLength;
+    bool     m_dropConsumed;
+    uint32_t m_dropped;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,347 @@
+#include <cstring>
+#include <cstdlib>
+#include "hex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_SIMD_X86
+#endif
+
+/*
+ * nibble-to-ASCII kernels used by the record encoder. every kernel writes
+ * 2 * len upper case digits to dst and returns the 8-bit sum of src,
+ * which is all the record checksum needs from the payload.
+ */
+typedef uint8_t (*hexEncodeKernel_t)(const uint8_t*, uint32_t, char*);
+/* length of the leading run of bytes equal to value */
+typedef uint32_t (*hexSpanKernel_t)(const uint8_t*, uint32_t, uint8_t);
+/*
+ * the reverse of encode: 2 * len hex digits (either case) from src into
+ * len bytes at dst, their 8-bit sum in *sum. returns the offset of the
+ * first character that is not a hex digit, 2 * len if there is none.
+ */
+typedef uint32_t (*hexDecodeKernel_t)(const char*, uint32_t, uint8_t*, uint8_t*);
+/* length of the leading run where a[i] == b[i] is equal */
+typedef uint32_t (*hexCompareKernel_t)(const uint8_t*, const uint8_t*, uint32_t, bool);
+
+static uint8_t encodeScalar(const uint8_t* src, uint32_t len, char* dst)
+{
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < len; i++) {
+        sum += src[i];
+        dst[i * 2 + 0] = hexUtils::hexDigits[src[i] >> 4];
+        dst[i * 2 + 1] = hexUtils::hexDigits[src[i] & 0x0F];
+    }
+    return sum;
+}
+
+static uint32_t spanScalar(const uint8_t* data, uint32_t len, uint8_t value)
+{
+    uint32_t i = 0;
+    while(i < len && data[i] == value) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t compareScalar(const uint8_t* a, const uint8_t* b, uint32_t len, bool equal)
+{
+    uint32_t i = 0;
+    while(i < len && (a[i] == b[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t decodeScalar(const char* src, uint32_t len, uint8_t* dst, uint8_t* sum)
+{
+    const uint8_t* p = (const uint8_t *)src;
+    uint8_t s = *sum;
+    for(uint32_t i = 0; i < len; i++) {
+        uint8_t h = hexUtils::hexNibble[p[i * 2 + 0]];
+        uint8_t l = hexUtils::hexNibble[p[i * 2 + 1]];
+        if((h | l) & 0xF0) {
+            *sum = s;
+            return i * 2 + ((h & 0xF0) ? 0 : 1);
+        }
+        dst[i] = h << 4 | l;
+        s += dst[i];
+    }
+    *sum = s;
+    return len * 2;
+}
+
+#ifdef HEX_SIMD_X86
+static uint32_t spanSse2(const uint8_t* data, uint32_t len, uint8_t value)
+{
+    const __m128i v = _mm_set1_epi8(value);
+    uint32_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), v));
+        if(mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + spanScalar(data + i, len - i, value);
+}
+
+static uint32_t compareSse2(const uint8_t* a, const uint8_t* b, uint32_t len, bool equal)
+{
+    const uint32_t run = equal ? 0xFFFF : 0;
+    uint32_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+        if(mask != run) {
+            return i + __builtin_ctz(mask ^ run);
+        }
+    }
+    return i + compareScalar(a + i, b + i, len - i, equal);
+}
+
+__attribute__((target("avx2")))
+static uint32_t compareAvx2(const uint8_t* a, const uint8_t* b, uint32_t len, bool equal)
+{
+    const uint32_t run = equal ? 0xFFFFFFFF : 0;
+    uint32_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i))));
+        if(mask != run) {
+            return i + __builtin_ctz(mask ^ run);
+        }
+    }
+    /* the tail runs legacy SSE code, leave the upper halves clean for it */
+    _mm256_zeroupper();
+    return i + compareSse2(a + i, b + i, len - i, equal);
+}
+
+__attribute__((target("avx2")))
+static uint32_t spanAvx2(const uint8_t* data, uint32_t len, uint8_t value)
+{
+    const __m256i v = _mm256_set1_epi8(value);
+    uint32_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), v));
+        if(mask != 0xFFFFFFFF) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    /* the tail runs legacy SSE code, leave the upper halves clean for it */
+    _mm256_zeroupper();
+    return i + spanSse2(data + i, len - i, value);
+}
+
+__attribute__((target("ssse3")))
+static uint8_t encodeSsse3(const uint8_t* src, uint32_t len, char* dst)
+{
+    const __m128i lut  = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                       '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 +  0), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    uint8_t sum = (uint8_t)(_mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4));
+    return sum + encodeScalar(src + i, len - i, dst + i * 2);
+}
+
+__attribute__((target("avx2")))
+static uint8_t encodeAvx2(const uint8_t* src, uint32_t len, char* dst)
+{
+    const __m256i lut  = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                          '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+                                          '0', '1', '2', '3', '4', '5', '6', '7',
+                                          '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+        /* unpack works per 128-bit lane, so put bytes 0-7/16-23 in the low lane first */
+        v = _mm256_permute4x64_epi64(v, 0xD8);
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 +  0), _mm256_unpacklo_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), _mm256_unpackhi_epi8(hi, lo));
+    }
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint8_t sum = (uint8_t)(_mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4));
+    _mm256_zeroupper();
+    return sum + encodeSsse3(src + i, len - i, dst + i * 2);
+}
+
+/*
+ * nibble values for 16 characters and a mask of the valid ones: digits are
+ * c - '0' <= 9, letters (c | 0x20) - 'a' <= 5, both as unsigned bytes.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i hexNibblesSsse3(__m128i c, __m128i* valid)
+{
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isDigit  = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+    *valid = _mm_or_si128(isDigit, isLetter);
+    return _mm_or_si128(_mm_and_si128(isDigit, d), _mm_and_si128(isLetter, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("ssse3")))
+static uint32_t decodeSsse3(const char* src, uint32_t len, uint8_t* dst, uint8_t* sum)
+{
+    /* hi * 16 + lo for every (hi, lo) byte pair */
+    const __m128i weight = _mm_set1_epi16(0x0110);
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for(; i + 8 <= len; i += 8) {
+        __m128i valid;
+        __m128i n = hexNibblesSsse3(_mm_loadu_si128((const __m128i *)(src + i * 2)), &valid);
+        uint32_t bad = ~_mm_movemask_epi8(valid) & 0xFFFF;
+        if(bad) {
+            return decodeScalar(src + i * 2, len - i, dst + i, sum) + i * 2;
+        }
+        __m128i b = _mm_packus_epi16(_mm_maddubs_epi16(n, weight), _mm_setzero_si128());
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(b, _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i *)(dst + i), b);
+    }
+    *sum += (uint8_t)_mm_cvtsi128_si32(acc);
+    return decodeScalar(src + i * 2, len - i, dst + i, sum) + i * 2;
+}
+
+__attribute__((target("avx2")))
+static uint32_t decodeAvx2(const char* src, uint32_t len, uint8_t* dst, uint8_t* sum)
+{
+    const __m256i weight = _mm256_set1_epi16(0x0110);
+    const __m256i zero   = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    /* record headers and short records never fill a 256-bit register */
+    if(len < 16) {
+        return decodeSsse3(src, len, dst, sum);
+    }
+
+    for(; i + 16 <= len; i += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+        __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+        __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        __m256i isDigit  = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+        __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+        if((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(isDigit, isLetter)) != 0xFFFFFFFF) {
+            break;
+        }
+        __m256i n = _mm256_or_si256(_mm256_and_si256(isDigit, d),
+                                    _mm256_and_si256(isLetter, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+        /* packus works per 128-bit lane, gather the two 8-byte halves */
+        __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_maddubs_epi16(n, weight), zero), 0xD8);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b, zero));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(b));
+    }
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    *sum += (uint8_t)(_mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4));
+    _mm256_zeroupper();
+    return decodeSsse3(src + i * 2, len - i, dst + i, sum) + i * 2;
+}
+#endif
+
+struct hex_kernels_t {
+    const char* name;
+    hexEncodeKernel_t encode;
+    hexSpanKernel_t span;
+    hexDecodeKernel_t decode;
+    hexCompareKernel_t compare;
+};
+
+static const hex_kernels_t scalarKernels = { "scalar", encodeScalar, spanScalar, decodeScalar, compareScalar };
+#ifdef HEX_SIMD_X86
+static const hex_kernels_t ssse3Kernels  = { "ssse3",  encodeSsse3,  spanSse2,   decodeSsse3,  compareSse2   };
+static const hex_kernels_t avx2Kernels   = { "avx2",   encodeAvx2,   spanAvx2,   decodeAvx2,   compareAvx2   };
+#endif
+
+static const hex_kernels_t* kernels = &scalarKernels;
+
+/*
+ * pick the widest kernels the cpu supports before main() runs, until then
+ * (static constructors elsewhere) the scalar ones serve. HEX_SIMD=scalar|
+ * ssse3|avx2 in the environment caps the choice.
+ */
+__attribute__((constructor))
+static void selectKernels(void)
+{
+    const char* limit = getenv("HEX_SIMD");
+    if(limit && !strcmp(limit, "scalar")) {
+        return;
+    }
+#ifdef HEX_SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) {
+        kernels = &ssse3Kernels;
+    }
+    if(limit && !strcmp(limit, "ssse3")) {
+        return;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        kernels = &avx2Kernels;
+    }
+#endif
+}
+
+uint8_t hexUtils::encodeHexBytes(const uint8_t* data, uint32_t len, char* buffer)
+{
+    return kernels->encode(data, len, buffer);
+}
+
+uint32_t hexUtils::decodeHexBytes(const char* text, uint32_t len, uint8_t* data, uint8_t* sum)
+{
+    return kernels->decode(text, len, data, sum);
+}
+
+uint32_t hexUtils::spanByte(const uint8_t* data, uint32_t len, uint8_t value)
+{
+    return kernels->span(data, len, value);
+}
+
+uint32_t hexUtils::spanEqual(const uint8_t* a, const uint8_t* b, uint32_t len)
+{
+    return kernels->compare(a, b, len, true);
+}
+
+uint32_t hexUtils::spanDiffer(const uint8_t* a, const uint8_t* b, uint32_t len)
+{
+    return kernels->compare(a, b, len, false);
+}
+
+uint32_t hexUtils::findFillRun(const uint8_t* data, uint32_t len, uint8_t fill, uint32_t minRun, uint32_t* runLen)
+{
+    uint32_t pos = 0;
+    while(pos < len) {
+        const uint8_t* p = (const uint8_t *)memchr(&data[pos], fill, len - pos);
+        if(!p) {
+            break;
+        }
+        uint32_t start = p - data;
+        uint32_t n = kernels->span(p, len - start, fill);
+        if(n >= minRun || start + n == len) {
+            *runLen = n;
+            return start;
+        }
+        pos = start + n;
+    }
+    *runLen = 0;
+    return len;
+}
+
+const char* hexUtils::simdKernelName(void)
+{
+    return kernels->name;
+}
@@ -2,12 +2,53 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hex.h"
+#include "../stm32_mkimage/elf_loader.h"
 
 #define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 #define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 #define LOGE(fmt, ...) printf("[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 
+#define BIN2HEX_CHUNK_SIZE      (64 * 1024)
+#define BIN2HEX_MAX_JOBS        256
+
+struct bin_fill_t {
+    bool enable;
+    uint8_t fill;
+    uint32_t minRun;
+    uint32_t runAddress;
+    uint64_t runLen;
+};
+struct bin_extent_t {
+    uint32_t address;
+    const uint8_t* data;
+    uint32_t dataLen;
+};
+struct bin_output_t {
+    uint8_t format;
+    uint8_t recordLen;
+    uint32_t jobs;
+    bool startValid;
+    uint32_t startAddress;
+};
+struct hex_segment_t {
+    uint32_t address;
+    const uint8_t* data;
+    uint32_t dataLen;
+    bool extRecord;
+    uint64_t outputOffset;
+    uint32_t outputLen;
+};
+
 static int32_t openFile(FILE** fp, const char* fileName)
 {
     if(!fp || !fileName) {
@@ -24,141 +65,792 @@ static int32_t closeFile(FILE** fp)
     if(!fp || !*fp) {
         return -1;
     }
-    fclose(*fp);
-    return 0;
+    int bRet = fclose(*fp);
+    *fp = NULL;
+    return bRet == 0 ? 0 : -1;
 }
-static int32_t writeFile(FILE* fp, const char* data)
+/* drop a failed output, only a regular file: /dev/full or a pipe must stay */
+static void removeFile(const char* fileName)
 {
-    // LOGD("hex data%s", data);
-    fwrite(data, strlen(data), 1, fp);
-    return 0;
+    struct stat sbuf;
+    if(stat(fileName, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        unlink(fileName);
+    }
 }
-static int32_t readFile(const char* fileName, uint8_t** buffer, uint32_t* len)
+static uint32_t readChunk(FILE* fp, uint8_t* buffer, uint32_t len)
 {
-    FILE* fp = NULL;
     uint32_t n = 0;
-    int32_t bRet = 0;
-    if(!fileName || !strlen(fileName) || !buffer || !len) {
-        LOGE("param error!");
-        return -1;
+    while(n < len) {
+        size_t r = fread(&buffer[n], 1, len - n, fp);
+        if(r == 0) {
+            break;
+        }
+        n += r;
+    }
+    return n;
+}
+static uint32_t createHexHead(uint8_t format, char* buffer)
+{
+    if(format == hexUtils::HEX_FORMAT_IHEX) {
+        return 0;
+    }
+    return hexUtils::encodeSRecord(0, 0, NULL, 0, buffer);
+}
+static uint32_t createHexEndOfLine(const bin_output_t* out, char* buffer)
+{
+    return hexUtils::encodeEndOfFile(out->format, out->startValid, out->startAddress, buffer);
+}
+static bool writeFillBytes(hexWriter* writer, uint32_t address, uint64_t len, uint8_t fill)
+{
+    uint8_t buffer[256];
+    memset(buffer, fill, sizeof(buffer));
+    while(len) {
+        uint32_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if(!writer->writeData(address, buffer, n)) {
+            return false;
+        }
+        address += n;
+        len -= n;
+    }
+    return true;
+}
+/*
+ * hand a chunk to the writer with every run of at least minRun fill bytes
+ * left out. a run reaching the end of the chunk is held back until the
+ * next chunk (or the end of the file) shows how long it is.
+ */
+static bool writeElided(hexWriter* writer, bin_fill_t* f, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    uint32_t pos = 0;
+    if(f->runLen) {
+        pos = hexUtils::spanByte(data, len, f->fill);
+        f->runLen += pos;
+        if(pos == len) {
+            return true;
+        }
+        if(f->runLen < f->minRun && !writeFillBytes(writer, f->runAddress, f->runLen, f->fill)) {
+            return false;
+        }
+        f->runLen = 0;
     }
-    *buffer = NULL;
-    *len    = 0;
+    while(pos < len) {
+        uint32_t n = 0;
+        uint32_t start = pos + hexUtils::findFillRun(&data[pos], len - pos, f->fill, f->minRun, &n);
+        if(start > pos && !writer->writeData(address + pos, &data[pos], start - pos)) {
+            return false;
+        }
+        if(n && start + n == len) {
+            f->runAddress = address + start;
+            f->runLen = n;
+            break;
+        }
+        pos = start + n;
+    }
+    return true;
+}
+static bool finishElided(hexWriter* writer, bin_fill_t* f)
+{
+    bool bRet = true;
+    if(f->runLen && f->runLen < f->minRun) {
+        bRet = writeFillBytes(writer, f->runAddress, f->runLen, f->fill);
+    }
+    f->runLen = 0;
+    return bRet;
+}
+/*
+ * stream the binary through a fixed chunk buffer, hexWriter keeps the
+ * record layout independent of where the chunks are cut.
+ */
+static int32_t writeHexData(hexWriter* writer, FILE* fp, const char* fileName, uint32_t address, bin_fill_t* f)
+{
+    uint8_t* chunk = NULL;
+    uint64_t total = 0;
+    int32_t bRet = 0;
 
-    fp = fopen(fileName, "r");
-    if(!fp) {
-        LOGE("open file %s error", fileName);
+    chunk = (uint8_t *)malloc(BIN2HEX_CHUNK_SIZE);
+    if(!chunk) {
+        LOGE("malloc chunk %d buffer failed", BIN2HEX_CHUNK_SIZE);
         return -1;
     }
-    fseek(fp, 0, SEEK_END);
-    *len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if(*len == 0) {
+    for(;;) {
+        uint32_t n = readChunk(fp, chunk, BIN2HEX_CHUNK_SIZE);
+        if(n == 0) {
+            break;
+        }
+        if(address + total + n > 0x100000000ULL) {
+            LOGE("file %s does not fit above address 0x%08x", fileName, address);
+            bRet = -1;
+            break;
+        }
+        if(f->enable ? !writeElided(writer, f, address + total, chunk, n) : !writer->writeData(address + total, chunk, n)) {
+            LOGE("write hex file failed");
+            bRet = -1;
+            break;
+        }
+        total += n;
+    }
+    if(bRet == 0 && f->enable && !finishElided(writer, f)) {
+        LOGE("write hex file failed");
+        bRet = -1;
+    }
+    if(ferror(fp)) {
+        LOGE("read file %s error", fileName);
+        bRet = -1;
+    } else if(bRet == 0 && total == 0) {
         LOGE("file %s size is null", fileName);
         bRet = -1;
+    }
+    free(chunk);
+    return bRet;
+}
+static void addExtent(std::vector<bin_extent_t>* extents, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    if(!extents->empty()) {
+        bin_extent_t* last = &extents->back();
+        if(last->address + last->dataLen == address && last->data + last->dataLen == data) {
+            last->dataLen += len;
+            return;
+        }
+    }
+    bin_extent_t extent = { address, data, len };
+    extents->push_back(extent);
+}
+/* same cut as writeElided, on a buffer that holds the whole file */
+static void collectExtents(std::vector<bin_extent_t>* extents, uint32_t address, const uint8_t* data, uint32_t len, const bin_fill_t* f)
+{
+    uint32_t pos = 0;
+    if(!f->enable) {
+        addExtent(extents, address, data, len);
+        return;
+    }
+    while(pos < len) {
+        uint32_t n = 0;
+        uint32_t start = pos + hexUtils::findFillRun(&data[pos], len - pos, f->fill, f->minRun, &n);
+        if(start > pos) {
+            addExtent(extents, address + pos, &data[pos], start - pos);
+        }
+        if(n && n < f->minRun) {
+            addExtent(extents, address + start, &data[start], n);
+        }
+        pos = start + n;
+    }
+}
+static void encodeSegments(const std::vector<hex_segment_t>* segments, std::atomic<uint32_t>* next, char* output, uint8_t format, uint8_t recordLen)
+{
+    for(;;) {
+        uint32_t i = next->fetch_add(1);
+        if(i >= segments->size()) {
+            break;
+        }
+        const hex_segment_t* seg = &(*segments)[i];
+        if(format == hexUtils::HEX_FORMAT_IHEX) {
+            hexUtils::encodeHexSegment(seg->address, seg->data, seg->dataLen, recordLen, seg->extRecord, &output[seg->outputOffset]);
+        } else {
+            hexUtils::encodeSRecordBlock(format, seg->address, seg->data, seg->dataLen, recordLen, &output[seg->outputOffset]);
+        }
+    }
+}
+static void addSegment(std::vector<hex_segment_t>* segments, uint32_t address, const uint8_t* data, uint32_t dataLen, const bin_output_t* out, uint64_t* outputLen)
+{
+    hex_segment_t seg;
+    seg.address = address;
+    seg.data = data;
+    seg.dataLen = dataLen;
+    if(out->format == hexUtils::HEX_FORMAT_IHEX) {
+        seg.extRecord = segments->empty() || (address >> 16) != (segments->back().address >> 16);
+        seg.outputLen = hexUtils::hexSegmentSize(dataLen, out->recordLen, seg.extRecord);
+    } else {
+        seg.extRecord = false;
+        seg.outputLen = hexUtils::sRecordBlockSize(out->format, dataLen, out->recordLen);
+    }
+    seg.outputOffset = *outputLen;
+    *outputLen += seg.outputLen;
+    segments->push_back(seg);
+}
+/*
+ * cut the extents into independently encodable segments with the record
+ * layout hexWriter gives: records run on across extents that touch in
+ * address, so a record straddling two of them is copied into bridge and
+ * gets a segment of its own.
+ */
+static void planSegments(const std::vector<bin_extent_t>* extents, const bin_output_t* out, std::vector<hex_segment_t>* segments, std::vector<uint8_t>* bridge, uint64_t* outputLen)
+{
+    uint32_t i = 0, pos = 0;
+    /* at most one bridge per extent, the segments point into it so it must not grow */
+    bridge->reserve(extents->size() * out->recordLen);
+    while(i < extents->size()) {
+        const bin_extent_t* extent = &(*extents)[i];
+        uint32_t address = extent->address + pos;
+        uint32_t segmentLeft = hexUtils::HEX_SEGMENT_SIZE - (address & 0xFFFF);
+        if(out->format != hexUtils::HEX_FORMAT_IHEX) {
+            segmentLeft = out->recordLen * hexWriter::HEX_WRITER_BLOCK_RECORDS;
+        }
+        uint32_t n = (extent->dataLen - pos) < segmentLeft ? (extent->dataLen - pos) : segmentLeft;
+        bool joined = n < segmentLeft && i + 1 < extents->size() &&
+            (uint64_t)extent->address + extent->dataLen == (*extents)[i + 1].address;
+        if(joined) {
+            n -= n % out->recordLen;
+        }
+        if(n) {
+            addSegment(segments, address, &extent->data[pos], n, out, outputLen);
+            pos += n;
+        }
+        if(pos == extent->dataLen) {
+            i++;
+            pos = 0;
+            continue;
+        }
+        if(!joined) {
+            continue;
+        }
+        uint32_t bridgeAddress = address + n;
+        uint32_t bridgeStart = bridge->size();
+        uint32_t want = (segmentLeft - n) < out->recordLen ? (segmentLeft - n) : out->recordLen;
+        while(want && i < extents->size() && (*extents)[i].address + pos == bridgeAddress + (bridge->size() - bridgeStart)) {
+            extent = &(*extents)[i];
+            uint32_t take = (extent->dataLen - pos) < want ? (extent->dataLen - pos) : want;
+            bridge->insert(bridge->end(), &extent->data[pos], &extent->data[pos + take]);
+            want -= take;
+            pos += take;
+            if(pos == extent->dataLen) {
+                i++;
+                pos = 0;
+            }
+        }
+        addSegment(segments, bridgeAddress, &(*bridge)[bridgeStart], bridge->size() - bridgeStart, out, outputLen);
+    }
+}
+/*
+ * the hex text size only depends on the data extents and the record
+ * length, so the output is sized up front, mapped, and every 64K address
+ * segment (with its type-04 record) is encoded straight into its final
+ * place by whichever worker picks it up. S-records are cut into blocks of
+ * whole records from the start of each extent instead.
+ */
+static int32_t writeExtentsParallel(const std::vector<bin_extent_t>* extents, const char* hexFile, const bin_output_t* out)
+{
+    int ofd = -1;
+    char* output = NULL;
+    uint64_t outputLen = 0;
+    char hexHead[64] = { 0 };
+    char hexEnd[64] = { 0 };
+    uint32_t hexHeadLen = 0, hexEndLen = 0;
+    std::vector<hex_segment_t> segments;
+    std::vector<uint8_t> bridge;
+    uint32_t jobs = out->jobs;
+    int32_t bRet = -1;
+
+    if(!extents->empty() && (uint64_t)extents->back().address + extents->back().dataLen - 1 > hexUtils::maxAddress(out->format)) {
+        LOGE("address 0x%08x does not fit the output format", (uint32_t)(extents->back().address + extents->back().dataLen - 1));
+        return -1;
+    }
+    if(out->startValid && out->startAddress > hexUtils::maxAddress(out->format)) {
+        LOGE("start address 0x%08x does not fit the output format", out->startAddress);
+        return -1;
+    }
+    hexHeadLen = createHexHead(out->format, hexHead);
+    hexEndLen = createHexEndOfLine(out, hexEnd);
+    outputLen = hexHeadLen;
+    planSegments(extents, out, &segments, &bridge, &outputLen);
+    outputLen += hexEndLen;
+
+    if((ofd = open(hexFile, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        LOGE("open file %s error", hexFile);
         goto exit;
     }
-    *buffer = (uint8_t *)malloc(sizeof(uint8_t) * (*len));
-    if(!(*buffer)) {
-        LOGE("malloc file %d buffer failed", (int32_t)(sizeof(uint8_t) * (*len)));
-        bRet = -1;
+    if(ftruncate(ofd, outputLen) < 0) {
+        LOGE("resize file %s to %llu error", hexFile, (unsigned long long)outputLen);
         goto exit;
     }
-
-    n = fread(*buffer, sizeof(unsigned char), *len, fp);
-    if(n == 0) {
-        LOGE("read file %s error", fileName);
-        bRet = -1;
+    output = (char *)mmap(NULL, outputLen, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+    if(output == MAP_FAILED) {
+        LOGE("mmap file %s error", hexFile);
+        output = NULL;
         goto exit;
     }
-    if(n != (*len)) {
-        LOGE("read file %s fail, fileLen %d, readLen %d", fileName, (int32_t)*len, (int32_t)n);
+    memcpy(output, hexHead, hexHeadLen);
+    memcpy(&output[outputLen - hexEndLen], hexEnd, hexEndLen);
+    {
+        std::atomic<uint32_t> next(0);
+        std::vector<std::thread> workers;
+        if(jobs > segments.size()) {
+            jobs = segments.size() ? segments.size() : 1;
+        }
+        for(uint32_t i = 1; i < jobs; i++) {
+            workers.push_back(std::thread(encodeSegments, &segments, &next, output, out->format, out->recordLen));
+        }
+        encodeSegments(&segments, &next, output, out->format, out->recordLen);
+        for(uint32_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+    bRet = 0;
+exit:
+    if(output) {
+        munmap(output, outputLen);
+    }
+    if(ofd >= 0 && close(ofd) < 0) {
+        LOGE("close file %s error", hexFile);
         bRet = -1;
+    }
+    if(ofd >= 0 && bRet) {
+        removeFile(hexFile);
+    }
+    return bRet;
+}
+static int32_t writeHexDataParallel(const char* binFile, const char* hexFile, uint32_t address, const bin_fill_t* f, const bin_output_t* out)
+{
+    int ifd = -1;
+    struct stat sbuf;
+    uint8_t* input = NULL;
+    std::vector<bin_extent_t> extents;
+    int32_t bRet = -1;
+
+    if((ifd = open(binFile, O_RDONLY)) < 0) {
+        LOGE("open file %s error", binFile);
+        return -1;
+    }
+    if(fstat(ifd, &sbuf) < 0 || sbuf.st_size == 0) {
+        LOGE("file %s size is null", binFile);
         goto exit;
     }
-    fclose(fp);
-    return 0;
+    if(address + (uint64_t)sbuf.st_size > 0x100000000ULL) {
+        LOGE("file %s does not fit above address 0x%08x", binFile, address);
+        goto exit;
+    }
+    input = (uint8_t *)mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+    if(input == MAP_FAILED) {
+        LOGE("mmap file %s error", binFile);
+        input = NULL;
+        goto exit;
+    }
+    collectExtents(&extents, address, input, sbuf.st_size, f);
+    bRet = writeExtentsParallel(&extents, hexFile, out);
 exit:
-    if(fp) {
-        fclose(fp);
+    if(input) {
+        munmap(input, sbuf.st_size);
     }
-    if(*buffer) {
-        free(*buffer);
+    close(ifd);
+    return bRet;
+}
+/*
+ * a file@address input, or an ELF that is placed by its own segments.
+ * the input is mapped and cut into pieces that point into the mapping.
+ */
+struct bin_input_t {
+    const char* fileName;
+    bool hasAddress;
+    uint32_t address;
+    uint8_t* map;
+    uint64_t mapLen;
+    bool elf;
+    struct elf_image elfImage;
+};
+struct bin_piece_t {
+    uint32_t address;
+    const uint8_t* data;
+    uint32_t dataLen;
+    const char* fileName;
+};
+
+static int32_t parseInput(char* arg, bin_input_t* input)
+{
+    memset(input, 0, sizeof(*input));
+    input->fileName = arg;
+    if(hexUtils::parseFileAddress(arg, &input->hasAddress, &input->address)) {
+        LOGE("invalid address in %s", arg);
+        return -1;
+    }
+    return 0;
+}
+static int32_t loadInput(bin_input_t* input)
+{
+    int fd = -1;
+    struct stat sbuf;
+    int32_t bRet = elf_load(input->fileName, &input->elfImage);
+    if(bRet < 0) {
+        LOGE("load file %s error, %s", input->fileName, elf_strerror(bRet));
+        return -1;
+    }
+    if(bRet == 0) {
+        input->elf = true;
+        if(input->hasAddress) {
+            LOGW("address 0x%08x of %s ignored, the elf segments carry their own", input->address, input->fileName);
+        }
+        return 0;
+    }
+    if(!input->hasAddress) {
+        LOGE("file %s is not an elf, give its address as %s@address", input->fileName, input->fileName);
+        return -1;
+    }
+    if((fd = open(input->fileName, O_RDONLY)) < 0) {
+        LOGE("open file %s error", input->fileName);
+        return -1;
+    }
+    if(fstat(fd, &sbuf) < 0 || sbuf.st_size == 0) {
+        LOGE("file %s size is null", input->fileName);
+        close(fd);
+        return -1;
+    }
+    if(input->address + (uint64_t)sbuf.st_size > 0x100000000ULL) {
+        LOGE("file %s does not fit above address 0x%08x", input->fileName, input->address);
+        close(fd);
+        return -1;
+    }
+    input->map = (uint8_t *)mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(input->map == MAP_FAILED) {
+        LOGE("mmap file %s error", input->fileName);
+        input->map = NULL;
+        return -1;
+    }
+    input->mapLen = sbuf.st_size;
+    return 0;
+}
+static void releaseInput(bin_input_t* input)
+{
+    if(input->elf) {
+        elf_release(&input->elfImage);
+    }
+    if(input->map) {
+        munmap(input->map, input->mapLen);
+    }
+    input->elf = false;
+    input->map = NULL;
+}
+static bool pieceLess(const bin_piece_t& a, const bin_piece_t& b)
+{
+    return a.address < b.address;
+}
+/*
+ * every piece of every input sorted by address, overlapping pieces are an
+ * error since there is no telling which one the target should end up with.
+ */
+static int32_t collectPieces(const std::vector<bin_input_t>* inputs, std::vector<bin_piece_t>* pieces)
+{
+    for(uint32_t i = 0; i < inputs->size(); i++) {
+        const bin_input_t* input = &(*inputs)[i];
+        if(!input->elf) {
+            bin_piece_t piece = { input->address, input->map, (uint32_t)input->mapLen, input->fileName };
+            pieces->push_back(piece);
+            continue;
+        }
+        for(int32_t j = 0; j < input->elfImage.nsegs; j++) {
+            const struct elf_segment* seg = &input->elfImage.segs[j];
+            bin_piece_t piece = { seg->paddr, seg->data, seg->size, input->fileName };
+            pieces->push_back(piece);
+        }
+    }
+    std::stable_sort(pieces->begin(), pieces->end(), pieceLess);
+    for(uint32_t i = 1; i < pieces->size(); i++) {
+        const bin_piece_t* prev = &(*pieces)[i - 1];
+        const bin_piece_t* cur = &(*pieces)[i];
+        if((uint64_t)prev->address + prev->dataLen > cur->address) {
+            LOGE("%s (0x%08x - 0x%08x) overlaps %s (0x%08x - 0x%08x)",
+                cur->fileName, cur->address, (uint32_t)(cur->address + cur->dataLen - 1),
+                prev->fileName, prev->address, (uint32_t)(prev->address + prev->dataLen - 1));
+            return -1;
+        }
+    }
+    return 0;
+}
+static int32_t writeExtents(const std::vector<bin_extent_t>* extents, const char* hexFile, const bin_output_t* out)
+{
+    FILE* outputFile = NULL;
+    int32_t bRet = 0;
+
+    if(out->jobs > 1) {
+        return writeExtentsParallel(extents, hexFile, out);
+    }
+    if(openFile(&outputFile, hexFile) != 0) {
+        LOGE("open file %s error", hexFile);
+        return -1;
+    }
+    {
+        hexWriter writer(outputFile);
+        if(!writer.valid()) {
+            LOGE("malloc output buffer failed");
+            bRet = -1;
+        }
+        writer.setFormat(out->format);
+        writer.setRecordLen(out->recordLen);
+        if(out->startValid) {
+            writer.setStartAddress(out->startAddress);
+        }
+        if(bRet == 0 && !writer.writeHeader()) {
+            bRet = -1;
+        }
+        for(uint32_t i = 0; bRet == 0 && i < extents->size(); i++) {
+            if(!writer.writeData((*extents)[i].address, (*extents)[i].data, (*extents)[i].dataLen)) {
+                bRet = -1;
+            }
+        }
+        if(bRet == 0 && !writer.writeEndOfFile()) {
+            bRet = -1;
+        }
+        if(bRet == 0 && !writer.flush()) {
+            bRet = -1;
+        }
+        if(bRet) {
+            LOGE("write hex file failed");
+        }
+    }
+    if(closeFile(&outputFile)) {
+        LOGE("close file %s error", hexFile);
+        bRet = -1;
+    }
+    if(bRet) {
+        removeFile(hexFile);
     }
-    *buffer = NULL;
-    *len    = 0;
     return bRet;
 }
-static void createHexHead(uint32_t address, char* buffer, uint32_t len)
+/* lastAddress is the highest address the output has to carry, an S-record format too narrow for it is refused */
+static int32_t formatByName(const char* name, uint32_t lastAddress)
+{
+    int32_t format = -1;
+    if(!strcmp(name, "ihex")) {
+        format = hexUtils::HEX_FORMAT_IHEX;
+    } else if(!strcmp(name, "s19")) {
+        format = hexUtils::HEX_FORMAT_S19;
+    } else if(!strcmp(name, "s28")) {
+        format = hexUtils::HEX_FORMAT_S28;
+    } else if(!strcmp(name, "s37")) {
+        format = hexUtils::HEX_FORMAT_S37;
+    } else if(!strcmp(name, "srec")) {
+        format = hexUtils::HEX_FORMAT_S19;
+        while(lastAddress > hexUtils::maxAddress(format)) {
+            format++;
+        }
+    }
+    if(format < 0) {
+        LOGE("unknown output format %s", name);
+        return -1;
+    }
+    if(lastAddress > hexUtils::maxAddress(format)) {
+        LOGE("address 0x%08x does not fit %s, use %s", lastAddress, name, lastAddress <= 0xFFFFFF ? "s28" : "s37");
+        return -1;
+    }
+    return format;
+}
+static bool isElfFile(const char* fileName)
 {
-    hexUtils::hex_data_t hex;
-    hex.recordType = hexUtils::HEX_RECORD_EXT_LINE_SEG_ADDR;
-    hex.recordLen = 2;
-    hex.loadOffset = 0;
-    address >>= 16;
-    hex.data[0] = (address & 0x0000FF00) >> 8;
-    hex.data[1] = (address & 0x000000FF) >> 0;
-    hexUtils::encodeHexData(&hex,  buffer, len);
+    unsigned char magic[4] = { 0 };
+    FILE* fp = fopen(fileName, "r");
+    if(!fp) {
+        return false;
+    }
+    uint32_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return elf_check_magic(magic, n);
 }
-static void createHexEndOfLine(char* buffer, uint32_t len)
+static uint32_t fileLastAddress(const char* fileName, uint32_t address)
 {
-    hexUtils::hex_data_t hex;
-    hex.recordType = hexUtils::HEX_RECORD_ENDOFFILE;
-    hex.recordLen = 0;
-    hex.loadOffset = 0;
-    hexUtils::encodeHexData(&hex, buffer, len);
+    struct stat sbuf;
+    if(stat(fileName, &sbuf) < 0 || sbuf.st_size == 0) {
+        return address;
+    }
+    if(address + (uint64_t)sbuf.st_size > 0x100000000ULL) {
+        return 0xFFFFFFFF;
+    }
+    return address + sbuf.st_size - 1;
+}
+/*
+ * all inputs in one pass: map them, sort their pieces by address, cut out
+ * the fill runs and encode the result as a single file. the entry point of
+ * the first ELF becomes the start address.
+ */
+static int32_t writeInputs(char** args, uint32_t count, const char* hexFile, const char* formatName, uint32_t recordLen, uint32_t jobs, const bin_fill_t* f)
+{
+    std::vector<bin_input_t> inputs(count);
+    std::vector<bin_piece_t> pieces;
+    std::vector<bin_extent_t> extents;
+    bin_output_t out = { 0, (uint8_t)recordLen, jobs, false, 0 };
+    uint32_t loaded = 0;
+    uint32_t lastAddress = 0;
+    int32_t format = -1;
+    int32_t bRet = -1;
+
+    for(loaded = 0; loaded < count; loaded++) {
+        if(parseInput(args[loaded], &inputs[loaded]) || loadInput(&inputs[loaded])) {
+            goto exit;
+        }
+        if(inputs[loaded].elf && !out.startValid) {
+            out.startValid = true;
+            out.startAddress = inputs[loaded].elfImage.entry;
+        } else if(inputs[loaded].elf) {
+            LOGW("entry of %s ignored, start address is 0x%08x", inputs[loaded].fileName, out.startAddress);
+        }
+    }
+    if(collectPieces(&inputs, &pieces)) {
+        goto exit;
+    }
+    for(uint32_t i = 0; i < pieces.size(); i++) {
+        LOGD("%s: 0x%08x - 0x%08x", pieces[i].fileName, pieces[i].address, (uint32_t)(pieces[i].address + pieces[i].dataLen - 1));
+        collectExtents(&extents, pieces[i].address, pieces[i].data, pieces[i].dataLen, f);
+    }
+    lastAddress = pieces.back().address + pieces.back().dataLen - 1;
+    if(out.startValid && out.startAddress > lastAddress) {
+        lastAddress = out.startAddress;
+    }
+    format = formatByName(formatName, lastAddress);
+    if(format < 0) {
+        goto exit;
+    }
+    if(recordLen > hexUtils::maxRecordLen(format)) {
+        LOGE("record width %d too large for %s, max %d", recordLen, formatName, hexUtils::maxRecordLen(format));
+        goto exit;
+    }
+    out.format = format;
+    LOGD("%d inputs, output:%s", count, hexFile);
+    bRet = writeExtents(&extents, hexFile, &out);
+exit:
+    for(uint32_t i = 0; i < loaded && i < count; i++) {
+        releaseInput(&inputs[i]);
+    }
+    return bRet;
 }
-static void createHexData(uint32_t offset, const uint8_t* data, uint32_t dataLen, char* outputBuffer, uint32_t outputBufferLen)
+static void usage(void)
 {
-    hexUtils::hex_data_t hex;
-    hex.recordType = hexUtils::HEX_RECORD_DATA;
-    hex.recordLen = dataLen;
-    hex.loadOffset = offset;
-    memcpy(hex.data, data, dataLen);
-    hexUtils::encodeHexData(&hex, outputBuffer, outputBufferLen);
+    printf("stm32_bin2hex [-j jobs] [-w width] [-s minrun] [-f fill] [-t format] [address] [bin file] [hex file]\n");
+    printf("stm32_bin2hex [-j jobs] [-w width] [-s minrun] [-f fill] [-t format] [file@address | elf file]... [hex file]\n");
+    printf("    -j jobs   encode with jobs threads into a preallocated output, 0 = all cpus\n");
+    printf("    -w width  data bytes per record, %d..%d (default %d)\n",
+        hexUtils::HEX_RECORD_MIN_LEN, hexUtils::HEX_RECORD_MAX_LEN, hexUtils::HEX_RECORD_DEFAULT_LEN);
+    printf("    -s minrun leave out runs of at least minrun fill bytes (erased flash)\n");
+    printf("    -f fill   fill byte for -s (default 0xFF)\n");
+    printf("    -t format ihex (default), s19, s28, s37, or srec to pick by the highest address\n");
 }
 int main(int argc, char** argv)
 {
-    if(argc <= 3) {
-        printf("stm32_bin2hex [address] [bin file] [hex file]\n");
+    uint32_t jobs = 1;
+    uint32_t recordLen = hexUtils::HEX_RECORD_DEFAULT_LEN;
+    bin_fill_t fill = { false, 0xFF, 0, 0, 0 };
+    const char* formatName = "ihex";
+    int32_t format = hexUtils::HEX_FORMAT_IHEX;
+    unsigned long value = 0;
+    char* end = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "j:w:s:f:t:")) != -1) {
+        switch(opt) {
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+                if(jobs == 0) {
+                    jobs = std::thread::hardware_concurrency();
+                }
+                if(jobs == 0 || jobs > BIN2HEX_MAX_JOBS) {
+                    jobs = BIN2HEX_MAX_JOBS;
+                }
+                break;
+            case 'w':
+                recordLen = strtoul(optarg, NULL, 0);
+                if(recordLen < hexUtils::HEX_RECORD_MIN_LEN || recordLen > hexUtils::HEX_RECORD_MAX_LEN) {
+                    LOGE("record width %s out of range", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                fill.minRun = strtoul(optarg, NULL, 0);
+                if(fill.minRun == 0) {
+                    LOGE("fill run length %s out of range", optarg);
+                    return -1;
+                }
+                fill.enable = true;
+                break;
+            case 'f':
+                value = strtoul(optarg, &end, 0);
+                if(optarg[0] == '\0' || *end != '\0' || value > 0xFF) {
+                    LOGE("fill byte %s out of range", optarg);
+                    return -1;
+                }
+                fill.fill = value;
+                break;
+            case 't':
+                formatName = optarg;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if(argc - optind < 2) {
+        usage();
         return -1;
     }
-    int binAddress = strtol(argv[1], NULL, 16);
-    const char* binFile = argv[2];
-    const char* hexFile = argv[3];
-    uint8_t* fileBuffer = NULL;
-    uint32_t fileLength = 0;
-    FILE* outputFile = NULL; 
-    char hexBuffer[256] = { 0 };
+    /* legacy form by syntax alone: three operands, no '@', the first one a hex address */
+    bool legacy = argc - optind == 3;
+    for(int i = optind; legacy && i < argc; i++) {
+        legacy = !strchr(argv[i], '@');
+    }
+    if(legacy) {
+        strtoul(argv[optind], &end, 16);
+        legacy = argv[optind][0] != '\0' && *end == '\0';
+    }
+    if(!legacy) {
+        return writeInputs(&argv[optind], argc - optind - 1, argv[argc - 1], formatName, recordLen, jobs, &fill);
+    }
+    if(isElfFile(argv[optind + 1])) {
+        LOGW("address %s ignored, the elf segments carry their own", argv[optind + 0]);
+        return writeInputs(&argv[optind + 1], 1, argv[optind + 2], formatName, recordLen, jobs, &fill);
+    }
+    uint32_t binAddress = strtoul(argv[optind + 0], NULL, 16);
+    const char* binFile = argv[optind + 1];
+    const char* hexFile = argv[optind + 2];
+    FILE* outputFile = NULL;
+    int32_t bRet = 0;
     LOGD("bin file:%s, address 0x%08x, output:%s", binFile, binAddress, hexFile);
-    if(readFile(binFile, &fileBuffer, &fileLength)) {
+    format = formatByName(formatName, fileLastAddress(binFile, binAddress));
+    if(format < 0) {
+        return -1;
+    }
+    if(recordLen > hexUtils::maxRecordLen(format)) {
+        LOGE("record width %d too large for %s, max %d", recordLen, formatName, hexUtils::maxRecordLen(format));
+        return -1;
+    }
+    bin_output_t out = { (uint8_t)format, (uint8_t)recordLen, jobs, false, 0 };
+    if(jobs > 1) {
+        return writeHexDataParallel(binFile, hexFile, binAddress, &fill, &out);
+    }
+    /* the input first, a missing one must not cost an existing output */
+    FILE* inputFile = fopen(binFile, "r");
+    if(!inputFile) {
+        LOGE("open file %s error", binFile);
         return -1;
     }
     if(openFile(&outputFile, hexFile) != 0) {
+        LOGE("open file %s error", hexFile);
+        fclose(inputFile);
         return -1;
     }
-    createHexHead(binAddress, hexBuffer, sizeof(hexBuffer));
-    writeFile(outputFile, hexBuffer);
-    for (uint32_t i = 0; ;)
     {
-        if(i + 16 <= fileLength) {
-            createHexData(i, &fileBuffer[i], 16, hexBuffer, sizeof(hexBuffer));
-            writeFile(outputFile, hexBuffer);
-        } else {
-            createHexData(i, &fileBuffer[i], fileLength % 16, hexBuffer, sizeof(hexBuffer));
-            writeFile(outputFile, hexBuffer);
-            break;
+        hexWriter writer(outputFile);
+        if(!writer.valid()) {
+            LOGE("malloc output buffer failed");
+            bRet = -1;
         }
-        i += 16;
-        if(i == fileLength) {
-            break;
+        writer.setFormat(format);
+        writer.setRecordLen(recordLen);
+        if(bRet == 0 && !writer.writeHeader()) {
+            bRet = -1;
+        }
+        if(bRet == 0) {
+            bRet = writeHexData(&writer, inputFile, binFile, binAddress, &fill);
         }
+        if(bRet == 0 && !writer.writeEndOfFile()) {
+            LOGE("write hex file failed");
+            bRet = -1;
+        }
+        if(bRet == 0 && !writer.flush()) {
+            LOGE("write hex file failed");
+            bRet = -1;
+        }
+    }
+    fclose(inputFile);
+    if(closeFile(&outputFile)) {
+        LOGE("close file %s error", hexFile);
+        bRet = -1;
     }
-    createHexEndOfLine(hexBuffer, sizeof(hexBuffer));
-    writeFile(outputFile, hexBuffer);
-    if(fileBuffer) {
-        free(fileBuffer);
+    if(bRet) {
+        removeFile(hexFile);
     }
-    closeFile(&outputFile);
-    return 0;
+    return bRet;
 }
@@ -0,0 +1,196 @@
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "memimage.h"
+
+memImage::memImage(uint32_t blockSize)
+    : m_blockSize(blockSize), m_blockUsed(blockSize), m_recordBytes(0), m_payloadBytes(0), m_sorted(true)
+{
+}
+
+memImage::~memImage()
+{
+    for(uint32_t i = 0; i < m_blocks.size(); i++) {
+        free(m_blocks[i]);
+    }
+}
+
+uint8_t* memImage::allocate(uint32_t len)
+{
+    if(m_blockSize - m_blockUsed < len) {
+        /* an oversized add gets a block of its own, the open block stays open */
+        uint32_t size = len > m_blockSize ? len : m_blockSize;
+        uint8_t* block = (uint8_t *)malloc(size);
+        if(!block) {
+            return NULL;
+        }
+        if(len > m_blockSize) {
+            m_blocks.insert(m_blocks.end() - (m_blocks.empty() ? 0 : 1), block);
+            return block;
+        }
+        m_blocks.push_back(block);
+        m_blockUsed = 0;
+    }
+    uint8_t* p = m_blocks.back() + m_blockUsed;
+    m_blockUsed += len;
+    return p;
+}
+
+bool memImage::add(uint32_t address, const uint8_t* data, uint32_t len)
+{
+    if(!len) {
+        return true;
+    }
+    if((uint64_t)address + len > 0x100000000ULL) {
+        return false;
+    }
+    uint8_t* p = allocate(len);
+    if(!p) {
+        return false;
+    }
+    memcpy(p, data, len);
+    m_recordBytes += len;
+    if(!m_pieces.empty()) {
+        piece_t* last = &m_pieces.back();
+        if((uint64_t)last->address + last->length == address && last->data + last->length == p) {
+            last->length += len;
+            return true;
+        }
+        if(address < last->address) {
+            m_sorted = false;
+        }
+    }
+    piece_t piece = { address, len, p };
+    m_pieces.push_back(piece);
+    return true;
+}
+
+void memImage::absorb(memImage* other, uint32_t offset)
+{
+    for(uint32_t i = 0; i < other->m_pieces.size(); i++) {
+        piece_t piece = other->m_pieces[i];
+        piece.address += offset;
+        if(!m_pieces.empty() && piece.address < m_pieces.back().address) {
+            m_sorted = false;
+        }
+        m_pieces.push_back(piece);
+    }
+    /* keep the open block last so add() continues to fill it */
+    m_blocks.insert(m_blocks.begin(), other->m_blocks.begin(), other->m_blocks.end());
+    m_recordBytes += other->m_recordBytes;
+    other->m_blocks.clear();
+    other->m_pieces.clear();
+    other->m_runs.clear();
+    other->m_overlaps.clear();
+    other->m_blockUsed = other->m_blockSize;
+    other->m_recordBytes = 0;
+    other->m_payloadBytes = 0;
+    other->m_sorted = true;
+}
+
+static bool pieceLess(const memImage::piece_t& a, const memImage::piece_t& b)
+{
+    return a.address < b.address;
+}
+static bool overlapLess(const memImage::overlap_t& a, const memImage::overlap_t& b)
+{
+    return a.address < b.address;
+}
+/*
+ * how the data was cut into pieces must not show in the report: sort the
+ * overlaps and join those that touch and agree on same/different data.
+ */
+static void joinOverlaps(std::vector<memImage::overlap_t>* overlaps)
+{
+    std::vector<memImage::overlap_t> joined;
+    int32_t last[2] = { -1, -1 };
+    std::stable_sort(overlaps->begin(), overlaps->end(), overlapLess);
+    for(uint32_t i = 0; i < overlaps->size(); i++) {
+        const memImage::overlap_t* o = &(*overlaps)[i];
+        int32_t k = last[o->same];
+        if(k >= 0 && (uint64_t)joined[k].address + joined[k].length >= o->address) {
+            uint64_t end = (uint64_t)o->address + o->length;
+            if(end > (uint64_t)joined[k].address + joined[k].length) {
+                joined[k].length = end - joined[k].address;
+            }
+            continue;
+        }
+        last[o->same] = joined.size();
+        joined.push_back(*o);
+    }
+    overlaps->swap(joined);
+}
+
+void memImage::finish(void)
+{
+    if(!m_sorted) {
+        std::stable_sort(m_pieces.begin(), m_pieces.end(), pieceLess);
+        m_sorted = true;
+    }
+    m_runs.clear();
+    m_overlaps.clear();
+    m_payloadBytes = 0;
+
+    /* cover is the piece reaching furthest so far, it holds any overlap with the next one */
+    const piece_t* cover = NULL;
+    for(uint32_t i = 0; i < m_pieces.size(); i++) {
+        const piece_t* p = &m_pieces[i];
+        uint64_t end = (uint64_t)p->address + p->length;
+        uint64_t coverEnd = cover ? (uint64_t)cover->address + cover->length : 0;
+        if(!cover || p->address > coverEnd) {
+            run_t run = { p->address, end };
+            m_runs.push_back(run);
+            m_payloadBytes += p->length;
+            cover = p;
+            continue;
+        }
+        if(p->address < coverEnd) {
+            uint64_t overlapEnd = end < coverEnd ? end : coverEnd;
+            overlap_t overlap;
+            overlap.address = p->address;
+            overlap.length = overlapEnd - p->address;
+            overlap.same = !memcmp(p->data, &cover->data[p->address - cover->address], overlap.length);
+            m_overlaps.push_back(overlap);
+        }
+        if(end > coverEnd) {
+            m_payloadBytes += end - coverEnd;
+            m_runs.back().end = end;
+            cover = p;
+        }
+    }
+    joinOverlaps(&m_overlaps);
+}
+
+void memImage::contents(void (*visit)(void* context, uint32_t address, const uint8_t* data, uint32_t len), void* context) const
+{
+    uint64_t done = 0;
+    for(uint32_t i = 0; i < m_pieces.size(); i++) {
+        const piece_t* p = &m_pieces[i];
+        uint64_t end = (uint64_t)p->address + p->length;
+        if(end <= done) {
+            continue;
+        }
+        uint64_t start = p->address > done ? p->address : done;
+        visit(context, start, &p->data[start - p->address], end - start);
+        done = end;
+    }
+}
+
+void memImage::banks(std::vector<bank_t>* banks) const
+{
+    banks->clear();
+    for(uint32_t i = 0; i < m_runs.size(); i++) {
+        uint64_t address = m_runs[i].address;
+        while(address < m_runs[i].end) {
+            uint64_t bankEnd = (address | (MEM_IMAGE_BANK_SIZE - 1)) + 1;
+            uint64_t end = bankEnd < m_runs[i].end ? bankEnd : m_runs[i].end;
+            uint16_t bank = address >> 16;
+            if(banks->empty() || banks->back().bank != bank) {
+                bank_t b = { bank, 0 };
+                banks->push_back(b);
+            }
+            banks->back().used += end - address;
+            address = end;
+        }
+    }
+}
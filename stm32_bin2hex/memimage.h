@@ -0,0 +1,84 @@
+#ifndef __STM32_MEMIMAGE_H__
+#define __STM32_MEMIMAGE_H__
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * sparse 32-bit memory image. the bytes of every add() are appended to a
+ * block arena and described by a piece (address, length, pointer); data
+ * that continues the previous piece in both address and arena just grows
+ * it, so a sequential hex file ends up as a handful of pieces and no
+ * allocation is made per record.
+ *
+ * finish() sorts the pieces by address (keeping the order they were added
+ * in for equal addresses) and builds the runs of populated addresses and
+ * the list of ranges that were written more than once.
+ */
+class memImage
+{
+public:
+    enum {
+        MEM_IMAGE_BLOCK_SIZE = 1024 * 1024,
+        MEM_IMAGE_BANK_SIZE  = 0x10000,
+    };
+    struct piece_t {
+        uint32_t address;
+        uint32_t length;
+        const uint8_t* data;
+    };
+    /* populated range, end is exclusive and may be 1 << 32 */
+    struct run_t {
+        uint32_t address;
+        uint64_t end;
+    };
+    struct overlap_t {
+        uint32_t address;
+        uint32_t length;
+        bool same;
+    };
+    struct bank_t {
+        uint16_t bank;
+        uint32_t used;
+    };
+    memImage(uint32_t blockSize = MEM_IMAGE_BLOCK_SIZE);
+    ~memImage();
+    bool add(uint32_t address, const uint8_t* data, uint32_t len);
+    /*
+     * move the pieces and arena of other into this image, addresses moved
+     * up by offset. other is left empty.
+     */
+    void absorb(memImage* other, uint32_t offset);
+    void finish(void);
+    /*
+     * hand every populated address to visit once, in address order, after
+     * finish(). where records overlap the piece sorted first supplies the
+     * bytes, the same one finish() compared the others against.
+     */
+    void contents(void (*visit)(void* context, uint32_t address, const uint8_t* data, uint32_t len), void* context) const;
+
+    const std::vector<piece_t>& pieces(void) const { return m_pieces; }
+    const std::vector<run_t>& runs(void) const { return m_runs; }
+    const std::vector<overlap_t>& overlaps(void) const { return m_overlaps; }
+    /* bytes handed to add(), overlaps counted every time */
+    uint64_t recordBytes(void) const { return m_recordBytes; }
+    /* distinct populated addresses */
+    uint64_t payloadBytes(void) const { return m_payloadBytes; }
+    /* populated bytes of every 64K bank that has any, in address order */
+    void banks(std::vector<bank_t>* banks) const;
+private:
+    memImage(const memImage&);
+    memImage& operator=(const memImage&);
+    uint8_t* allocate(uint32_t len);
+    std::vector<uint8_t*> m_blocks;
+    std::vector<piece_t>  m_pieces;
+    std::vector<run_t>    m_runs;
+    std::vector<overlap_t> m_overlaps;
+    uint32_t m_blockSize;
+    uint32_t m_blockUsed;
+    uint64_t m_recordBytes;
+    uint64_t m_payloadBytes;
+    bool     m_sorted;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "hex.h"
+
+/*
+ * Motorola S-record backend, "S<type><count><address><data><checksum>".
+ * count covers address, data and checksum bytes, the checksum is the
+ * ones' complement of the sum of count, address and data bytes.
+ */
+
+uint8_t hexUtils::sRecordAddressLen(uint8_t recordType)
+{
+    static const uint8_t addressLen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+    return recordType < 10 ? addressLen[recordType] : 0;
+}
+
+uint32_t hexUtils::maxRecordLen(uint8_t format)
+{
+    switch(format) {
+        case HEX_FORMAT_S19: return 255 - 1 - 2;
+        case HEX_FORMAT_S28: return 255 - 1 - 3;
+        case HEX_FORMAT_S37: return 255 - 1 - 4;
+        default:
+            return HEX_RECORD_MAX_LEN;
+    }
+}
+
+uint32_t hexUtils::maxAddress(uint8_t format)
+{
+    switch(format) {
+        case HEX_FORMAT_S19: return 0xFFFF;
+        case HEX_FORMAT_S28: return 0xFFFFFF;
+        default:
+            return 0xFFFFFFFF;
+    }
+}
+
+uint32_t hexUtils::encodeSRecord(uint8_t recordType, uint32_t address, const uint8_t* data, uint8_t recordLen, char* buffer)
+{
+    uint8_t addressLen = sRecordAddressLen(recordType);
+    uint8_t count = addressLen + recordLen + 1;
+    uint8_t sum = count;
+    char* p = buffer;
+
+    *p++ = 'S';
+    *p++ = '0' + recordType;
+    p = putHexByte(p, count);
+    for(int32_t i = addressLen - 1; i >= 0; i--) {
+        sum += address >> (i * 8);
+        p = putHexByte(p, address >> (i * 8));
+    }
+    sum += encodeHexBytes(data, recordLen, p);
+    p += recordLen * 2;
+    p = putHexByte(p, ~sum);
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buffer;
+}
+
+uint32_t hexUtils::sRecordBlockSize(uint8_t format, uint32_t dataLen, uint8_t recordLen)
+{
+    if(!recordLen) {
+        return 0;
+    }
+    uint8_t addressLen = sRecordAddressLen(format);
+    uint32_t size = (dataLen / recordLen) * SREC_RECORD_TEXT_LEN(addressLen, recordLen);
+    if(dataLen % recordLen) {
+        size += SREC_RECORD_TEXT_LEN(addressLen, dataLen % recordLen);
+    }
+    return size;
+}
+
+uint32_t hexUtils::encodeSRecordBlock(uint8_t format, uint32_t address, const uint8_t* data, uint32_t dataLen, uint8_t recordLen, char* buffer)
+{
+    uint32_t n = 0;
+    if(dataLen && (uint64_t)address + dataLen - 1 > maxAddress(format)) {
+        return 0;
+    }
+    while(dataLen) {
+        uint8_t len = dataLen < recordLen ? dataLen : recordLen;
+        n += encodeSRecord(format, address, data, len, &buffer[n]);
+        address += len;
+        data += len;
+        dataLen -= len;
+    }
+    return n;
+}
+
+int32_t hexUtils::decodeSRecordHeader(const char* text, uint32_t len, struct srec_data_t* srec, uint32_t* errorOffset)
+{
+    uint8_t raw[5];
+    uint8_t sum = 0;
+    uint32_t n;
+
+    if(len < 4 || text[0] != 'S' || text[1] < '0' || text[1] > '9' || text[1] == '4') {
+        return HEX_DECODE_MALFORMED;
+    }
+    uint8_t addressLen = sRecordAddressLen(text[1] - '0');
+    if(len < 4 + addressLen * 2U) {
+        return HEX_DECODE_MALFORMED;
+    }
+    /* count and address */
+    n = decodeHexBytes(&text[2], 1 + addressLen, raw, &sum);
+    if(n != (1 + addressLen) * 2U) {
+        if(errorOffset) {
+            *errorOffset = 2 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
+    }
+    if(raw[0] < addressLen + 1 || len != 4 + (uint32_t)raw[0] * 2) {
+        return HEX_DECODE_MALFORMED;
+    }
+    srec->recordType = text[1] - '0';
+    srec->recordLen = raw[0] - addressLen - 1;
+    srec->address = 0;
+    for(uint32_t i = 0; i < addressLen; i++) {
+        srec->address = srec->address << 8 | raw[1 + i];
+    }
+    return HEX_DECODE_OK;
+}
+
+int32_t hexUtils::decodeSRecord(const char* text, uint32_t len, struct srec_data_t* srec, uint32_t* errorOffset)
+{
+    uint8_t raw[256];
+    uint8_t count = 0;
+    uint8_t sum = 0;
+    uint32_t n;
+
+    if(len < 4 || text[0] != 'S' || text[1] < '0' || text[1] > '9' || text[1] == '4') {
+        return HEX_DECODE_MALFORMED;
+    }
+    n = decodeHexBytes(&text[2], 1, &count, &sum);
+    if(n != 2) {
+        if(errorOffset) {
+            *errorOffset = 2 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
+    }
+    uint8_t addressLen = sRecordAddressLen(text[1] - '0');
+    if(count < addressLen + 1 || len != 4 + (uint32_t)count * 2) {
+        return HEX_DECODE_MALFORMED;
+    }
+    /* address, data and checksum */
+    n = decodeHexBytes(&text[4], count, raw, &sum);
+    if(n != count * 2U) {
+        if(errorOffset) {
+            *errorOffset = 4 + n;
+        }
+        return HEX_DECODE_BAD_DIGIT;
+    }
+    srec->recordType = text[1] - '0';
+    srec->recordLen = count - addressLen - 1;
+    srec->address = 0;
+    for(uint32_t i = 0; i < addressLen; i++) {
+        srec->address = srec->address << 8 | raw[i];
+    }
+    memcpy(srec->data, &raw[addressLen], srec->recordLen);
+    srec->chksum = raw[count - 1];
+    /* the checksum is the ones' complement, so everything sums to 0xFF */
+    return sum == 0xFF ? HEX_DECODE_OK : HEX_DECODE_CHECKSUM;
+}
@@ -0,0 +1,268 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../stm32_bin2hex/hex.h"
+
+#define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGE(fmt, ...) printf("[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+
+#define HEX2BIN_FILL_SIZE       (64 * 1024)
+
+/* output window, end is exclusive so the whole 4 GiB space fits */
+struct bin_window_t {
+    bool     hasStart;
+    bool     hasEnd;
+    uint64_t start;
+    uint64_t end;
+};
+/* address range written with data, gaps get the fill byte */
+struct bin_range_t {
+    uint64_t start;
+    uint64_t end;
+};
+struct bin_output_t {
+    int fd;
+    uint8_t fill;
+    struct bin_window_t window;
+    std::vector<bin_range_t> written;
+    uint64_t dataBytes;
+};
+/*
+ * walk the records from the start of the file and hand every data record
+ * to handler. any record that does not decode stops the conversion.
+ */
+static int32_t walkHexFile(hexReader* reader, hexReader::walkHandler_t handler, void* context)
+{
+    hexReader::walk_t walk;
+    char error[80];
+    memset(&walk, 0, sizeof(walk));
+    reader->assign(reader->data(), 0, reader->size());
+    if(reader->walk(&walk, handler, context)) {
+        if(walk.error) {
+            LOGE("%s", hexReader::walkError(&walk, error, sizeof(error)));
+        }
+        return -1;
+    }
+    return 0;
+}
+static int32_t findExtent(void* context, const hexReader::walk_data_t* d)
+{
+    struct bin_window_t* extent = (struct bin_window_t *)context;
+    uint32_t address = d->address;
+    uint32_t len = d->len;
+    if(!extent->hasStart || address < extent->start) {
+        extent->start = address;
+        extent->hasStart = true;
+    }
+    if(!extent->hasEnd || (uint64_t)address + len > extent->end) {
+        extent->end = (uint64_t)address + len;
+        extent->hasEnd = true;
+    }
+    return 0;
+}
+/* clip the record to the window and pwrite it at its offset in the output */
+static int32_t writeData(void* context, const hexReader::walk_data_t* d)
+{
+    struct bin_output_t* out = (struct bin_output_t *)context;
+    uint32_t address = d->address;
+    const uint8_t* data = d->data;
+    uint32_t len = d->len;
+    uint64_t start = address;
+    uint64_t end = (uint64_t)address + len;
+    if(start < out->window.start) {
+        start = out->window.start;
+    }
+    if(end > out->window.end) {
+        end = out->window.end;
+    }
+    if(start >= end) {
+        return 0;
+    }
+    data += start - address;
+    len = end - start;
+    if(pwrite(out->fd, data, len, start - out->window.start) != (ssize_t)len) {
+        LOGE("write data at 0x%08x error", (uint32_t)start);
+        return -1;
+    }
+    out->dataBytes += len;
+    if(!out->written.empty() && out->written.back().end == start) {
+        out->written.back().end = end;
+    } else {
+        bin_range_t range = { start, end };
+        out->written.push_back(range);
+    }
+    return 0;
+}
+static bool rangeLess(const bin_range_t& a, const bin_range_t& b)
+{
+    return a.start < b.start;
+}
+/*
+ * the output was sized with ftruncate, so every byte no record wrote is a
+ * hole that reads back as zero. a zero fill leaves them that way, any
+ * other fill is written into the gaps between the merged data ranges.
+ */
+static int32_t fillGaps(struct bin_output_t* out)
+{
+    uint8_t* buffer = NULL;
+    uint64_t pos = out->window.start;
+    if(out->fill == 0x00) {
+        return 0;
+    }
+    buffer = (uint8_t *)malloc(HEX2BIN_FILL_SIZE);
+    if(!buffer) {
+        LOGE("malloc fill %d buffer failed", HEX2BIN_FILL_SIZE);
+        return -1;
+    }
+    memset(buffer, out->fill, HEX2BIN_FILL_SIZE);
+    std::sort(out->written.begin(), out->written.end(), rangeLess);
+    for(uint32_t i = 0; i <= out->written.size(); i++) {
+        uint64_t gapEnd = i < out->written.size() ? out->written[i].start : out->window.end;
+        while(pos < gapEnd) {
+            uint32_t n = (gapEnd - pos) < HEX2BIN_FILL_SIZE ? (gapEnd - pos) : HEX2BIN_FILL_SIZE;
+            if(pwrite(out->fd, buffer, n, pos - out->window.start) != (ssize_t)n) {
+                LOGE("write fill at 0x%08x error", (uint32_t)pos);
+                free(buffer);
+                return -1;
+            }
+            pos += n;
+        }
+        if(i < out->written.size() && out->written[i].end > pos) {
+            pos = out->written[i].end;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+/* drop a failed output, only a regular file: /dev/full or a pipe must stay */
+static void removeFile(const char* fileName)
+{
+    struct stat sbuf;
+    if(stat(fileName, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        unlink(fileName);
+    }
+}
+static void usage(void)
+{
+    printf("stm32_hex2bin [-f fill] [-s start] [-e end] [HEX FILE] [BIN FILE]\n");
+    printf("    -f fill   byte for addresses no record covers (default 0xFF)\n");
+    printf("    -s start  first address of the output (hex, default lowest data address)\n");
+    printf("    -e end    address after the last byte of the output (hex, default end of the data)\n");
+}
+int main(int argc, char** argv)
+{
+    struct bin_output_t out;
+    hexReader reader;
+    unsigned long long value = 0;
+    char* end = NULL;
+    int32_t bRet = -1;
+    int opt;
+    out.fd = -1;
+    out.fill = 0xFF;
+    out.dataBytes = 0;
+    memset(&out.window, 0, sizeof(out.window));
+    while((opt = getopt(argc, argv, "f:s:e:")) != -1) {
+        switch(opt) {
+            case 'f':
+                value = strtoull(optarg, &end, 0);
+                if(optarg[0] == '\0' || *end != '\0' || value > 0xFF) {
+                    LOGE("fill byte %s out of range", optarg);
+                    usage();
+                    return -1;
+                }
+                out.fill = value;
+                break;
+            case 's':
+                value = strtoull(optarg, &end, 16);
+                if(optarg[0] == '\0' || *end != '\0' || value > 0xFFFFFFFFULL) {
+                    LOGE("start address %s out of range", optarg);
+                    usage();
+                    return -1;
+                }
+                out.window.start = value;
+                out.window.hasStart = true;
+                break;
+            case 'e':
+                /* exclusive, 100000000 ends the window at the top of the address space */
+                value = strtoull(optarg, &end, 16);
+                if(optarg[0] == '\0' || *end != '\0' || value > 0x100000000ULL) {
+                    LOGE("end address %s out of range", optarg);
+                    usage();
+                    return -1;
+                }
+                out.window.end = value;
+                out.window.hasEnd = true;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if(argc - optind < 2) {
+        usage();
+        return -1;
+    }
+    const char* hexFile = argv[optind + 0];
+    const char* binFile = argv[optind + 1];
+    LOGD("hex file:%s, output:%s", hexFile, binFile);
+    if(!reader.open(hexFile)) {
+        LOGE("open file %s error", hexFile);
+        return -1;
+    }
+    if(!out.window.hasStart || !out.window.hasEnd) {
+        /* an open window side comes from the data, which takes a first pass */
+        struct bin_window_t extent;
+        memset(&extent, 0, sizeof(extent));
+        if(walkHexFile(&reader, findExtent, &extent)) {
+            goto exit;
+        }
+        if(!extent.hasStart) {
+            LOGE("file %s has no data", hexFile);
+            goto exit;
+        }
+        if(!out.window.hasStart) {
+            out.window.start = extent.start;
+        }
+        if(!out.window.hasEnd) {
+            out.window.end = extent.end;
+        }
+    }
+    if(out.window.end <= out.window.start || out.window.end > 0x100000000ULL) {
+        LOGE("empty or invalid address window 0x%llx - 0x%llx", (unsigned long long)out.window.start, (unsigned long long)out.window.end);
+        goto exit;
+    }
+    LOGD("window 0x%08x - 0x%08x, fill 0x%02x", (uint32_t)out.window.start, (uint32_t)(out.window.end - 1), out.fill);
+
+    out.fd = open(binFile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(out.fd < 0) {
+        LOGE("open file %s error", binFile);
+        goto exit;
+    }
+    if(ftruncate(out.fd, out.window.end - out.window.start) < 0) {
+        LOGE("resize file %s error", binFile);
+        goto exit;
+    }
+    if(walkHexFile(&reader, writeData, &out) || fillGaps(&out)) {
+        goto exit;
+    }
+    LOGD("%llu data bytes, %llu bytes output", (unsigned long long)out.dataBytes, (unsigned long long)(out.window.end - out.window.start));
+    bRet = 0;
+exit:
+    if(out.fd >= 0 && close(out.fd) < 0) {
+        LOGE("close file %s error", binFile);
+        bRet = -1;
+    }
+    if(out.fd >= 0 && bRet) {
+        /* a truncated image must not reach the flasher */
+        removeFile(binFile);
+    }
+    return bRet;
+}
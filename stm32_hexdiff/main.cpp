@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "../stm32_bin2hex/hex.h"
+#include "../stm32_bin2hex/memimage.h"
+
+#define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGE(fmt, ...) printf("[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+
+enum {
+    DIFF_RANGE_DIFFER = 0,
+    DIFF_RANGE_ONLY_A,
+    DIFF_RANGE_ONLY_B,
+};
+static const char* rangeKindName[] = { "differ", "only in A", "only in B" };
+
+/* populated bytes at address, pointing into the image or the mapped file */
+struct diff_extent_t {
+    uint32_t address;
+    uint32_t length;
+    const uint8_t* data;
+};
+/*
+ * one side of the comparison: a hex file decoded into an image, or a
+ * binary given as file@address used straight from its mapping.
+ */
+struct diff_input_t {
+    char* fileName;
+    bool hasAddress;
+    uint32_t address;
+    hexReader reader;
+    memImage image;
+    std::vector<diff_extent_t> extents;
+};
+struct diff_range_t {
+    uint8_t  kind;
+    uint32_t address;
+    uint64_t end;
+};
+struct diff_result_t {
+    bool pending;
+    struct diff_range_t range;
+    uint64_t compared;
+    uint64_t bytes[3];
+    uint32_t ranges[3];
+};
+
+static int32_t parseInput(char* arg, diff_input_t* input)
+{
+    input->fileName = arg;
+    if(hexUtils::parseFileAddress(arg, &input->hasAddress, &input->address)) {
+        LOGE("invalid address in %s", arg);
+        return -1;
+    }
+    return 0;
+}
+static int32_t addData(void* context, const hexReader::walk_data_t* d)
+{
+    diff_input_t* input = (diff_input_t *)context;
+    if(!input->image.add(d->address, d->data, d->len)) {
+        LOGE("%s: data at line %u dropped, out of memory or address space", input->fileName, d->record->line);
+        return -1;
+    }
+    return 0;
+}
+/* every data record into the image, any record that does not decode is an error */
+static int32_t loadHexFile(diff_input_t* input)
+{
+    hexReader::walk_t walk;
+    char error[80];
+    memset(&walk, 0, sizeof(walk));
+    if(input->reader.walk(&walk, addData, input)) {
+        if(walk.error) {
+            LOGE("%s: %s", input->fileName, hexReader::walkError(&walk, error, sizeof(error)));
+        }
+        return -1;
+    }
+    input->image.finish();
+    const std::vector<memImage::overlap_t>& overlaps = input->image.overlaps();
+    for(uint32_t i = 0; i < overlaps.size(); i++) {
+        if(!overlaps[i].same) {
+            LOGW("%s: 0x%08x - 0x%08x written twice with different data, the first record is compared", input->fileName,
+                overlaps[i].address, overlaps[i].address + overlaps[i].length - 1);
+        }
+    }
+    return 0;
+}
+static void addExtent(void* context, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    std::vector<diff_extent_t>* extents = (std::vector<diff_extent_t> *)context;
+    diff_extent_t extent = { address, len, data };
+    extents->push_back(extent);
+}
+static int32_t loadInput(diff_input_t* input)
+{
+    if(!input->reader.open(input->fileName)) {
+        LOGE("open file %s error", input->fileName);
+        return -1;
+    }
+    if(input->hasAddress) {
+        if(input->address + (uint64_t)input->reader.size() > 0x100000000ULL) {
+            LOGE("file %s does not fit above address 0x%08x", input->fileName, input->address);
+            return -1;
+        }
+        addExtent(&input->extents, input->address, input->reader.data(), input->reader.size());
+        return 0;
+    }
+    if(loadHexFile(input)) {
+        return -1;
+    }
+    input->image.contents(addExtent, &input->extents);
+    return 0;
+}
+/* print a range once it can grow no further, touching ranges of one kind are joined */
+static void flushRange(diff_result_t* result)
+{
+    if(!result->pending) {
+        return;
+    }
+    const diff_range_t* r = &result->range;
+    LOGD("%-9s 0x%08x - 0x%08x, %llu bytes", rangeKindName[r->kind], r->address, (uint32_t)(r->end - 1),
+        (unsigned long long)(r->end - r->address));
+    result->ranges[r->kind]++;
+    result->bytes[r->kind] += r->end - r->address;
+    result->pending = false;
+}
+static void addRange(diff_result_t* result, uint8_t kind, uint32_t address, uint32_t len)
+{
+    if(result->pending && result->range.kind == kind && result->range.end == address) {
+        result->range.end += len;
+        return;
+    }
+    flushRange(result);
+    result->range.kind = kind;
+    result->range.address = address;
+    result->range.end = (uint64_t)address + len;
+    result->pending = true;
+}
+/*
+ * walk both extent lists in address order. where both sides have data
+ * the bytes are compared with the SIMD span kernels, which step over
+ * identical runs 32 bytes at a time and stop at the first difference.
+ */
+static void diffExtents(const std::vector<diff_extent_t>* a, const std::vector<diff_extent_t>* b, diff_result_t* result)
+{
+    uint32_t i = 0, j = 0;
+    uint32_t aSkip = 0, bSkip = 0;
+    while(i < a->size() || j < b->size()) {
+        const diff_extent_t* ea = i < a->size() ? &(*a)[i] : NULL;
+        const diff_extent_t* eb = j < b->size() ? &(*b)[j] : NULL;
+        uint64_t aStart = ea ? (uint64_t)ea->address + aSkip : 0x100000000ULL;
+        uint64_t bStart = eb ? (uint64_t)eb->address + bSkip : 0x100000000ULL;
+        uint64_t aEnd = ea ? (uint64_t)ea->address + ea->length : 0;
+        uint64_t bEnd = eb ? (uint64_t)eb->address + eb->length : 0;
+        uint32_t len;
+        if(aStart < bStart) {
+            len = (aEnd < bStart ? aEnd : bStart) - aStart;
+            addRange(result, DIFF_RANGE_ONLY_A, aStart, len);
+            aSkip += len;
+        } else if(bStart < aStart) {
+            len = (bEnd < aStart ? bEnd : aStart) - bStart;
+            addRange(result, DIFF_RANGE_ONLY_B, bStart, len);
+            bSkip += len;
+        } else {
+            len = (aEnd < bEnd ? aEnd : bEnd) - aStart;
+            const uint8_t* pa = &ea->data[aSkip];
+            const uint8_t* pb = &eb->data[bSkip];
+            uint32_t k = 0;
+            while(k < len) {
+                k += hexUtils::spanEqual(&pa[k], &pb[k], len - k);
+                if(k < len) {
+                    uint32_t n = hexUtils::spanDiffer(&pa[k], &pb[k], len - k);
+                    addRange(result, DIFF_RANGE_DIFFER, aStart + k, n);
+                    k += n;
+                }
+            }
+            result->compared += len;
+            aSkip += len;
+            bSkip += len;
+        }
+        if(ea && aSkip == ea->length) {
+            i++;
+            aSkip = 0;
+        }
+        if(eb && bSkip == eb->length) {
+            j++;
+            bSkip = 0;
+        }
+    }
+    flushRange(result);
+}
+static void usage(void)
+{
+    printf("stm32_hexdiff [A] [B]\n");
+    printf("    compare the memory content of two images, each a hex file (Intel HEX or S-record)\n");
+    printf("    or a binary given as FILE@address (hex), e.g. a flash readback\n");
+    printf("    exit status 0 if they hold the same bytes, 1 if not, -1 on error\n");
+}
+int main(int argc, char** argv)
+{
+    if(argc != 3) {
+        usage();
+        return -1;
+    }
+    diff_input_t inputs[2];
+    diff_result_t result;
+    memset(&result, 0, sizeof(result));
+    for(uint32_t i = 0; i < 2; i++) {
+        if(parseInput(argv[1 + i], &inputs[i])) {
+            return -1;
+        }
+        LOGD("%c: %s", 'A' + i, inputs[i].fileName);
+        if(loadInput(&inputs[i])) {
+            return -1;
+        }
+    }
+    diffExtents(&inputs[0].extents, &inputs[1].extents, &result);
+    LOGD("%llu bytes compared, %llu differ in %u ranges", (unsigned long long)result.compared,
+        (unsigned long long)result.bytes[DIFF_RANGE_DIFFER], result.ranges[DIFF_RANGE_DIFFER]);
+    LOGD("%llu bytes only in A in %u ranges, %llu bytes only in B in %u ranges",
+        (unsigned long long)result.bytes[DIFF_RANGE_ONLY_A], result.ranges[DIFF_RANGE_ONLY_A],
+        (unsigned long long)result.bytes[DIFF_RANGE_ONLY_B], result.ranges[DIFF_RANGE_ONLY_B]);
+    if(result.ranges[DIFF_RANGE_DIFFER] || result.ranges[DIFF_RANGE_ONLY_A] || result.ranges[DIFF_RANGE_ONLY_B]) {
+        return 1;
+    }
+    return 0;
+}
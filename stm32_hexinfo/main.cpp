@@ -2,75 +2,82 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+#include "../stm32_bin2hex/hex.h"
+#include "../stm32_bin2hex/memimage.h"
+#include "../stm32_mkimage/crc.h"
 
-#define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
-#define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
-#define LOGE(fmt, ...) printf("[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+/*
+ * -j workers log into a per-chunk memory stream, printed in file order.
+ * json output keeps stdout for the document, LOGE goes to stderr then.
+ */
+static thread_local FILE* logFile = NULL;
+static bool logQuiet = false;
+#define LOGOUT         (logFile ? logFile : stdout)
+#define LOGD(fmt, ...) do { if(!logQuiet) fprintf(LOGOUT, "[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__); } while(0)
+#define LOGW(fmt, ...) do { if(!logQuiet) fprintf(LOGOUT, "[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__); } while(0)
+#define LOGE(fmt, ...) fprintf(logQuiet ? stderr : LOGOUT, "[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 
-struct hex_data_t {
-    uint8_t recordMark;
-    uint8_t recordLen;
-    uint16_t loadOffset;
-    uint8_t  recordType;
-    uint8_t  data[256];
-    uint8_t  chksum;
+#define HEXINFO_MAX_JOBS        256
+
+enum {
+    HEXINFO_OUTPUT_TEXT = 0,
+    HEXINFO_OUTPUT_JSON,
+    HEXINFO_OUTPUT_NDJSON,
 };
-static int32_t readHexFile(const char* fileName, uint8_t** buffer, uint32_t* len)
-{
-    FILE* fp = NULL;
-    uint32_t n = 0;
-    int32_t bRet = 0;
-    if(!fileName || !strlen(fileName) || !buffer || !len) {
-        LOGE("param error!");
-        return -1;
-    }
-    *buffer = NULL;
-    *len    = 0;
+enum {
+    HEXINFO_ERROR_MALFORMED = 0,
+    HEXINFO_ERROR_CHECKSUM,
+    HEXINFO_ERROR_BAD_DIGIT,
+};
+static const char* errorKindName[] = { "malformed", "checksum", "bad_digit" };
 
-    fp = fopen(fileName, "r");
-    if(!fp) {
-        LOGE("open file %s error", fileName);
-        return -1;
-    }
-    fseek(fp, 0, SEEK_END);
-    *len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if(*len == 0) {
-        LOGE("file %s size is null", fileName);
-        bRet = -1;
-        goto exit;
-    }
-    *buffer = (uint8_t *)malloc(sizeof(uint8_t) * (*len));
-    if(!(*buffer)) {
-        LOGE("malloc file %d buffer failed", (int32_t)(sizeof(uint8_t) * (*len)));
-        bRet = -1;
-        goto exit;
-    }
+struct hex_info_t {
+    uint64_t records;
+    uint64_t dataBytes;
+    uint32_t errors;
+    uint64_t hexTypes[256];
+    uint64_t srecTypes[10];
+    bool     startValid;
+    uint32_t startAddress;
+};
+/* contiguous data records seen by the summary, end is exclusive */
+struct hex_span_t {
+    uint32_t address;
+    uint64_t end;
+    uint64_t records;
+};
+/* a record that did not decode, offset is from the start of the file */
+struct hex_error_t {
+    uint8_t  kind;
+    uint32_t offset;
+    uint32_t line;
+    uint32_t column;
+};
+/*
+ * one slice of the file. data records seen before the slice's first
+ * type-02/04 record only know their 16-bit offset, they go to prefix
+ * until the base address carried over from earlier slices is known.
+ */
+struct hex_chunk_t {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t line;
+    uint32_t lines;
+    struct hex_info_t info;
+    bool     baseKnown;
+    uint32_t base;
+    memImage* image;
+    memImage* prefix;
+    std::vector<hex_error_t>* errors;
+    char*    log;
+    size_t   logLen;
+};
 
-    n = fread(*buffer, sizeof(unsigned char), *len, fp);
-    if(n == 0) {
-        LOGE("read file %s error", fileName);
-        bRet = -1;
-        goto exit;
-    }
-    if(n != (*len)) {
-        LOGE("read file %s fail, fileLen %d, readLen %d", fileName, (int32_t)*len, (int32_t)n);
-        bRet = -1;
-        goto exit;
-    }
-    fclose(fp);
-    return 0;
-exit:
-    if(fp) {
-        fclose(fp);
-    }
-    if(*buffer) {
-        free(*buffer);
-    }
-    *buffer = NULL;
-    *len    = 0;
-    return bRet;
-}
 static void printBuffer(const uint8_t* buffer, uint32_t len)
 {
     uint32_t printSize = 0;
@@ -106,7 +113,7 @@ static void printBuffer(const uint8_t* buffer, uint32_t len)
 static const char* hexStreamToString(const uint8_t* buffer, uint32_t len)
 {
     #define HEXSTRINGLEN  511
-    static char tmp[HEXSTRINGLEN + 1] = { 0 };
+    static thread_local char tmp[HEXSTRINGLEN + 1] = { 0 };
     memset(tmp, 0, HEXSTRINGLEN);
     if(len > HEXSTRINGLEN) {
         LOGW("hex stream size %d > %d", len, HEXSTRINGLEN);
@@ -117,46 +124,9 @@ static const char* hexStreamToString(const uint8_t* buffer, uint32_t len)
     }
     return tmp;
 }
-static void printHexData(const struct hex_data_t* hex)
-{
-    LOGD("mask: 0x%02x, len: %d, offset: 0x%08x, type: %d, checknum: 0x%02x", hex->recordMark, hex->recordLen, hex->loadOffset, hex->recordType, hex->chksum);
-}
-static uint8_t OI(uint8_t c)
+static void printHexData(const struct hexUtils::hex_data_t* hex)
 {
-    if('0' <= c && c <= '9') {
-        return c - '0';
-    }
-    if('a' <= c && c <= 'f') {
-        return c - 'a' + 10;
-    }
-    if('A' <= c && c <= 'F') {
-        return c - 'A' + 10;
-    }
-    return 0;
-}
-static bool hexCheckSum(const uint8_t* data, const struct hex_data_t* hex)
-{
-    bool bRet = false;
-    uint8_t sum = 0;
-
-    #define TI2(h) (OI(data[h]) << 4 | OI(data[h + 1]))
-    sum += TI2(0);
-    sum += TI2(2);
-    sum += TI2(4);
-    sum += TI2(6);
-    
-    for(uint32_t i = 0, j = 0; i < hex->recordLen; i++) {
-        sum += TI2(j + 8);
-        j += 2;
-        
-    }
-    sum = ~sum + 1;
-    if(sum == hex->chksum) {
-        bRet = true;
-    } else {
-        LOGW("checksum error %02x, %02x", sum, hex->chksum);
-    }
-    return bRet;
+    LOGD("len: %d, offset: 0x%08x, type: %d, checknum: 0x%02x", hex->recordLen, hex->loadOffset, hex->recordType, hex->chksum);
 }
 static uint32_t hexDataToAddress(const uint8_t* data, uint8_t len)
 {
@@ -166,7 +136,7 @@ static uint32_t hexDataToAddress(const uint8_t* data, uint8_t len)
     }
     return bRet;
 }
-static void parseHexData(const struct hex_data_t* hex)
+static void parseHexData(const struct hexUtils::hex_data_t* hex)
 {
     switch(hex->recordType) {
     //  case 0:
@@ -179,64 +149,558 @@ static void parseHexData(const struct hex_data_t* hex)
             break;
     }
 }
-static void parseHexFile(const uint8_t* buffer, uint32_t len)
+static void addData(struct hex_chunk_t* chunk, uint32_t address, const uint8_t* data, uint32_t len)
 {
-    struct hex_data_t hex;
-    bool hexStartFlag = false;
-    uint8_t tmp[512] = { 0 };
-    uint32_t index = 0;
-    uint32_t pos = 0;
-    for(uint32_t i = 0; i < len; i++) {
-        if(buffer[i] == ':') {
-            hexStartFlag = true;
-            memset(&hex, 0, sizeof(struct hex_data_t));
-            memset(tmp, 0, sizeof(tmp));
-            index = 0;
-            pos = 0;
-        }
-        if(buffer[i] == 0x0A && buffer[i - 1] == 0x0D) {
-            hexStartFlag = false;
-            #define TI(h) (OI(tmp[h]) << 4 | OI(tmp[h + 1]))
-            hex.recordMark = tmp[0];
-            hex.recordLen = TI(1);
-            hex.loadOffset = TI(3) << 8 | TI(5);
-            hex.recordType = TI(7);
-            pos = 9;
-            for(uint32_t i = 0; i < hex.recordLen; i++) {
-                hex.data[i] = TI(pos);
-                pos += 2;    
+    memImage* image = chunk->baseKnown ? chunk->image : chunk->prefix;
+    chunk->info.dataBytes += len;
+    if(!image->add(chunk->baseKnown ? chunk->base + address : address, data, len)) {
+        LOGE("data at 0x%08x dropped, out of memory or address space", address);
+        chunk->info.errors++;
+    }
+}
+static void addError(struct hex_chunk_t* chunk, uint8_t kind, uint32_t offset, uint32_t line, uint32_t column)
+{
+    hex_error_t error = { kind, offset, line, column };
+    chunk->info.errors++;
+    chunk->errors->push_back(error);
+}
+static void printBadDigit(const uint8_t* text, uint32_t len, uint32_t offset, uint32_t fileOffset, uint32_t line)
+{
+    LOGW("invalid character 0x%02x at offset %u (line %u, column %u)", text[offset], fileOffset + offset, line, offset + 1);
+    LOGD("%s", hexStreamToString(text, len));
+}
+static void parseSRecord(struct hex_chunk_t* chunk, const uint8_t* text, uint32_t len, uint32_t fileOffset, uint32_t line)
+{
+    struct hexUtils::srec_data_t srec;
+    uint32_t errorOffset = 0;
+    int32_t bRet = hexUtils::decodeSRecord((const char *)text, len, &srec, &errorOffset);
+    if(bRet == hexUtils::HEX_DECODE_BAD_DIGIT) {
+        addError(chunk, HEXINFO_ERROR_BAD_DIGIT, fileOffset + errorOffset, line, errorOffset + 1);
+        printBadDigit(text, len, errorOffset, fileOffset, line);
+        return;
+    }
+    if(bRet == hexUtils::HEX_DECODE_MALFORMED) {
+        addError(chunk, HEXINFO_ERROR_MALFORMED, fileOffset, line, 1);
+        LOGW("malformed record");
+        LOGD("%s", hexStreamToString(text, len));
+        return;
+    }
+    if(bRet == hexUtils::HEX_DECODE_CHECKSUM) {
+        addError(chunk, HEXINFO_ERROR_CHECKSUM, fileOffset, line, 1);
+        LOGW("checksum error 0x%02x", srec.chksum);
+        LOGD("type: S%d, len: %d, address: 0x%08x", srec.recordType, srec.recordLen, srec.address);
+        LOGD("%s", hexStreamToString(text, len));
+        return;
+    }
+    chunk->info.records++;
+    chunk->info.srecTypes[srec.recordType]++;
+    if(7 <= srec.recordType && srec.recordType <= 9) {
+        chunk->info.startValid = true;
+        chunk->info.startAddress = srec.address;
+    }
+    if(1 <= srec.recordType && srec.recordType <= 3) {
+        chunk->info.dataBytes += srec.recordLen;
+        if(!chunk->image->add(srec.address, srec.data, srec.recordLen)) {
+            LOGE("data at 0x%08x dropped, out of memory or address space", srec.address);
+            chunk->info.errors++;
+        }
+    }
+    switch(srec.recordType) {
+    //  case 1: case 2: case 3:
+        case 0: LOGD("header %s", hexStreamToString(srec.data, srec.recordLen)); break;
+        case 5:
+        case 6: LOGD("(%d)record count", srec.address); break;
+        case 7:
+        case 8:
+        case 9: LOGD("(0x%08x)start address, S%d end line", srec.address, srec.recordType); break;
+        default:
+            break;
+    }
+}
+static void parseHexRecord(struct hex_chunk_t* chunk, const uint8_t* text, uint32_t len, struct hexUtils::hex_data_t* hex, uint32_t fileOffset, uint32_t line)
+{
+    uint32_t errorOffset = 0;
+    int32_t bRet = hexUtils::decodeHexRecord((const char *)text, len, hex, &errorOffset);
+    if(bRet == hexUtils::HEX_DECODE_BAD_DIGIT) {
+        addError(chunk, HEXINFO_ERROR_BAD_DIGIT, fileOffset + errorOffset, line, errorOffset + 1);
+        printBadDigit(text, len, errorOffset, fileOffset, line);
+    } else if(bRet == hexUtils::HEX_DECODE_MALFORMED) {
+        addError(chunk, HEXINFO_ERROR_MALFORMED, fileOffset, line, 1);
+        LOGW("malformed record");
+        LOGD("%s", hexStreamToString(text, len));
+    } else if(bRet == hexUtils::HEX_DECODE_CHECKSUM) {
+        addError(chunk, HEXINFO_ERROR_CHECKSUM, fileOffset, line, 1);
+        LOGW("checksum error 0x%02x", hex->chksum);
+        printHexData(hex);
+        LOGD("%s", hexStreamToString(text, len));
+    } else {
+        chunk->info.records++;
+        chunk->info.hexTypes[hex->recordType]++;
+        switch(hex->recordType) {
+            case 0: addData(chunk, hex->loadOffset, hex->data, hex->recordLen); break;
+            case 2: chunk->baseKnown = true; chunk->base = hexDataToAddress(hex->data, hex->recordLen) << 4; break;
+            case 4: chunk->baseKnown = true; chunk->base = hexDataToAddress(hex->data, hex->recordLen) << 16; break;
+            case 3:
+                /* CS:IP */
+                chunk->info.startValid = true;
+                chunk->info.startAddress = (hexDataToAddress(hex->data, 2) << 4) + hexDataToAddress(&hex->data[2], 2);
+                break;
+            case 5: chunk->info.startValid = true; chunk->info.startAddress = hexDataToAddress(hex->data, hex->recordLen); break;
+            default:
+                break;
+        }
+        parseHexData(hex);
+    }
+}
+/*
+ * records are decoded in place from the file buffer, hex is reused for
+ * every one of them and only the bytes a record carries are written.
+ */
+static void parseHexFile(const uint8_t* buffer, struct hex_chunk_t* chunk)
+{
+    struct hexUtils::hex_data_t hex;
+    hexReader::record_t record;
+    hexReader reader;
+    reader.assign(buffer, chunk->begin, chunk->end, chunk->line);
+    while(reader.next(&record)) {
+        if(record.text[0] == 'S') {
+            parseSRecord(chunk, record.text, record.len, record.offset, record.line);
+        } else {
+            parseHexRecord(chunk, record.text, record.len, &hex, record.offset, record.line);
+        }
+    }
+}
+static void addSpan(std::vector<hex_span_t>* spans, uint32_t address, uint32_t len)
+{
+    if(!spans->empty() && spans->back().end == address) {
+        spans->back().end += len;
+        spans->back().records++;
+        return;
+    }
+    hex_span_t span = { address, (uint64_t)address + len, 1 };
+    spans->push_back(span);
+}
+/*
+ * address map only: data records are known by their header, the payload
+ * is neither decoded nor checksummed and the reader skips it using the
+ * length field. all other records, and any whose header does not decode,
+ * go through the full parse.
+ */
+static void summarizeHexFile(const uint8_t* buffer, struct hex_chunk_t* chunk, std::vector<hex_span_t>* spans)
+{
+    struct hexUtils::hex_data_t hex;
+    struct hexUtils::srec_data_t srec;
+    hexReader::record_t record;
+    hexReader reader;
+    reader.assign(buffer, chunk->begin, chunk->end, chunk->line);
+    reader.trustLength(true);
+    while(reader.next(&record)) {
+        const char* text = (const char *)record.text;
+        if(text[0] == 'S') {
+            if(hexUtils::decodeSRecordHeader(text, record.len, &srec) == hexUtils::HEX_DECODE_OK &&
+                1 <= srec.recordType && srec.recordType <= 3) {
+                chunk->info.records++;
+                chunk->info.srecTypes[srec.recordType]++;
+                chunk->info.dataBytes += srec.recordLen;
+                addSpan(spans, srec.address, srec.recordLen);
+                continue;
             }
-            hex.chksum = TI(pos);
-            if(hexCheckSum(&tmp[1], &hex) == false) {
-                printHexData(&hex);
-                LOGD("%s", hexStreamToString(tmp, index));
-            } else {
-            // todo.
-                parseHexData(&hex);
+            parseSRecord(chunk, record.text, record.len, record.offset, record.line);
+        } else {
+            if(hexUtils::decodeHexHeader(text, record.len, &hex) == hexUtils::HEX_DECODE_OK &&
+                hex.recordType == hexUtils::HEX_RECORD_DATA) {
+                chunk->info.records++;
+                chunk->info.hexTypes[hex.recordType]++;
+                chunk->info.dataBytes += hex.recordLen;
+                addSpan(spans, chunk->base + hex.loadOffset, hex.recordLen);
+                continue;
+            }
+            parseHexRecord(chunk, record.text, record.len, &hex, record.offset, record.line);
+        }
+    }
+}
+static bool spanLess(const hex_span_t& a, const hex_span_t& b)
+{
+    return a.address < b.address;
+}
+/* segments with their record count, records that overlap are merged */
+static void printSummary(std::vector<hex_span_t>* spans, const struct hex_info_t* info)
+{
+    std::vector<hex_span_t> segments;
+    std::stable_sort(spans->begin(), spans->end(), spanLess);
+    for(uint32_t i = 0; i < spans->size(); i++) {
+        const hex_span_t* span = &(*spans)[i];
+        if(span->end == span->address) {
+            continue;
+        }
+        if(!segments.empty() && segments.back().end >= span->address) {
+            if(span->end > segments.back().end) {
+                segments.back().end = span->end;
             }
+            segments.back().records += span->records;
+            continue;
+        }
+        segments.push_back(*span);
+    }
+    for(uint32_t i = 0; i < segments.size(); i++) {
+        LOGD("segment 0x%08x - 0x%08x, %llu bytes, %llu records", segments[i].address, (uint32_t)(segments[i].end - 1),
+            (unsigned long long)(segments[i].end - segments[i].address), (unsigned long long)segments[i].records);
+    }
+    if(info->startValid) {
+        LOGD("start address 0x%08x", info->startAddress);
+    }
+}
+static void countLines(const uint8_t* buffer, struct hex_chunk_t* chunk)
+{
+    const uint8_t* p = &buffer[chunk->begin];
+    const uint8_t* end = &buffer[chunk->end];
+    chunk->lines = 0;
+    while(p < end && (p = (const uint8_t *)memchr(p, 0x0A, end - p)) != NULL) {
+        chunk->lines++;
+        p++;
+    }
+}
+static void parseChunk(const uint8_t* buffer, struct hex_chunk_t* chunk)
+{
+    logFile = open_memstream(&chunk->log, &chunk->logLen);
+    parseHexFile(buffer, chunk);
+    if(logFile) {
+        fclose(logFile);
+        logFile = NULL;
+    }
+}
+/*
+ * cut the file right after a line end near every len / jobs, count the
+ * lines of each slice so the messages carry file-wide line numbers, then
+ * decode the slices in parallel and print their logs in file order.
+ */
+static void parseHexFileParallel(const uint8_t* buffer, uint32_t len, uint32_t jobs, std::vector<hex_chunk_t>* chunks)
+{
+    uint32_t begin = 0;
+    for(uint32_t k = 1; k <= jobs && begin < len; k++) {
+        uint32_t end = (uint64_t)len * k / jobs;
+        if(end < begin) {
+            end = begin;
+        }
+        const uint8_t* lf = (end < len) ? (const uint8_t *)memchr(&buffer[end], 0x0A, len - end) : NULL;
+        end = lf ? (lf - buffer) + 1 : len;
+        hex_chunk_t chunk;
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.begin = begin;
+        chunk.end = end;
+        chunk.image = new memImage();
+        chunk.prefix = new memImage();
+        chunk.errors = new std::vector<hex_error_t>();
+        chunks->push_back(chunk);
+        begin = end;
+    }
+    std::vector<std::thread> workers;
+    for(uint32_t i = 0; i < chunks->size(); i++) {
+        workers.push_back(std::thread(countLines, buffer, &(*chunks)[i]));
+    }
+    for(uint32_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    for(uint32_t i = 0, line = 1; i < chunks->size(); i++) {
+        (*chunks)[i].line = line;
+        line += (*chunks)[i].lines;
+    }
+    (*chunks)[0].baseKnown = true;
+    for(uint32_t i = 0; i < chunks->size(); i++) {
+        workers.push_back(std::thread(parseChunk, buffer, &(*chunks)[i]));
+    }
+    for(uint32_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    for(uint32_t i = 0; i < chunks->size(); i++) {
+        if((*chunks)[i].log) {
+            fwrite((*chunks)[i].log, 1, (*chunks)[i].logLen, stdout);
+            free((*chunks)[i].log);
+            (*chunks)[i].log = NULL;
         }
-        if(hexStartFlag) {
-            tmp[index++] = buffer[i];
+    }
+}
+/* carry the base address from slice to slice and add everything up */
+static void mergeChunks(std::vector<hex_chunk_t>* chunks, struct hex_info_t* info, memImage* image, std::vector<hex_error_t>* errors)
+{
+    uint32_t base = 0;
+    memset(info, 0, sizeof(*info));
+    for(uint32_t i = 0; i < chunks->size(); i++) {
+        hex_chunk_t* chunk = &(*chunks)[i];
+        if(chunk->prefix) {
+            image->absorb(chunk->prefix, base);
+            delete chunk->prefix;
+        }
+        image->absorb(chunk->image, 0);
+        delete chunk->image;
+        chunk->prefix = NULL;
+        chunk->image = NULL;
+        info->records += chunk->info.records;
+        info->dataBytes += chunk->info.dataBytes;
+        info->errors += chunk->info.errors;
+        for(uint32_t k = 0; k < 256; k++) {
+            info->hexTypes[k] += chunk->info.hexTypes[k];
+        }
+        for(uint32_t k = 0; k < 10; k++) {
+            info->srecTypes[k] += chunk->info.srecTypes[k];
+        }
+        if(chunk->info.startValid) {
+            info->startValid = true;
+            info->startAddress = chunk->info.startAddress;
+        }
+        errors->insert(errors->end(), chunk->errors->begin(), chunk->errors->end());
+        delete chunk->errors;
+        chunk->errors = NULL;
+        if(chunk->baseKnown) {
+            base = chunk->base;
         }
     }
+    image->finish();
+}
+/* segments, the gaps between them, overlapping records and bank usage */
+static void printImage(const memImage* image)
+{
+    const std::vector<memImage::run_t>& runs = image->runs();
+    const std::vector<memImage::overlap_t>& overlaps = image->overlaps();
+    std::vector<memImage::bank_t> banks;
+    for(uint32_t i = 0; i < runs.size(); i++) {
+        if(i) {
+            LOGD("gap     0x%08x - 0x%08x, %llu bytes", (uint32_t)runs[i - 1].end, runs[i].address - 1,
+                (unsigned long long)(runs[i].address - runs[i - 1].end));
+        }
+        LOGD("segment 0x%08x - 0x%08x, %llu bytes", runs[i].address, (uint32_t)(runs[i].end - 1),
+            (unsigned long long)(runs[i].end - runs[i].address));
+    }
+    for(uint32_t i = 0; i < overlaps.size(); i++) {
+        LOGW("overlap 0x%08x - 0x%08x, %u bytes, %s data", overlaps[i].address, overlaps[i].address + overlaps[i].length - 1,
+            overlaps[i].length, overlaps[i].same ? "same" : "different");
+    }
+    image->banks(&banks);
+    for(uint32_t i = 0; i < banks.size(); i++) {
+        LOGD("bank 0x%04x: %u/%u bytes, %.1f%% filled", banks[i].bank, banks[i].used, memImage::MEM_IMAGE_BANK_SIZE,
+            banks[i].used * 100.0 / memImage::MEM_IMAGE_BANK_SIZE);
+    }
+    LOGD("payload %llu bytes in %u segments, %u overlaps", (unsigned long long)image->payloadBytes(),
+        (uint32_t)runs.size(), (uint32_t)overlaps.size());
+}
+/*
+ * crc32 of every segment, and a fingerprint chaining the address, length
+ * and bytes of all segments. neither depends on record widths, record
+ * order or the file format, only on what ends up in memory.
+ */
+struct hex_digest_t {
+    const std::vector<memImage::run_t>* runs;
+    std::vector<uint32_t> crcs;
+    uint32_t fingerprint;
+};
+static void digestData(void* context, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    struct hex_digest_t* digest = (struct hex_digest_t *)context;
+    if(digest->crcs.empty() || address >= (*digest->runs)[digest->crcs.size() - 1].end) {
+        const memImage::run_t* run = &(*digest->runs)[digest->crcs.size()];
+        uint64_t length = run->end - run->address;
+        uint8_t head[16];
+        for(uint32_t i = 0; i < 8; i++) {
+            head[i] = (uint64_t)run->address >> (i * 8);
+            head[8 + i] = length >> (i * 8);
+        }
+        digest->fingerprint = crc32(digest->fingerprint, head, sizeof(head));
+        digest->crcs.push_back(0);
+    }
+    digest->crcs.back() = crc32(digest->crcs.back(), data, len);
+    digest->fingerprint = crc32(digest->fingerprint, data, len);
+}
+static void printJsonString(const char* str)
+{
+    putchar('"');
+    for(const uint8_t* p = (const uint8_t *)str; *p; p++) {
+        if(*p == '"' || *p == '\\') {
+            printf("\\%c", *p);
+        } else if(*p < 0x20) {
+            printf("\\u%04x", *p);
+        } else {
+            putchar(*p);
+        }
+    }
+    putchar('"');
+}
+/*
+ * json is one document, ndjson one object per line (segments, overlaps,
+ * errors) closed by a summary line. addresses and sizes are numbers,
+ * crc32 and the fingerprint 8-digit hex strings.
+ */
+static void printJson(const char* hexFile, const struct hex_info_t* info, const memImage* image,
+    const std::vector<hex_error_t>* errors, uint32_t output)
+{
+    const std::vector<memImage::run_t>& runs = image->runs();
+    const std::vector<memImage::overlap_t>& overlaps = image->overlaps();
+    bool ndjson = output == HEXINFO_OUTPUT_NDJSON;
+    const char* sep = ndjson ? "\n" : ",";
+    struct hex_digest_t digest;
+    digest.runs = &runs;
+    digest.fingerprint = 0;
+    image->contents(digestData, &digest);
+
+    if(!ndjson) {
+        printf("{\"file\":");
+        printJsonString(hexFile);
+        printf(",\"segments\":[");
+    }
+    for(uint32_t i = 0; i < runs.size(); i++) {
+        printf("%s{%s\"address\":%u,\"end\":%llu,\"length\":%llu,\"crc32\":\"%08x\"}", (i && !ndjson) ? sep : "",
+            ndjson ? "\"type\":\"segment\"," : "", runs[i].address, (unsigned long long)runs[i].end,
+            (unsigned long long)(runs[i].end - runs[i].address), digest.crcs[i]);
+        if(ndjson) {
+            printf("\n");
+        }
+    }
+    if(!ndjson) {
+        printf("],\"overlaps\":[");
+    }
+    for(uint32_t i = 0; i < overlaps.size(); i++) {
+        printf("%s{%s\"address\":%u,\"length\":%u,\"same\":%s}", (i && !ndjson) ? sep : "",
+            ndjson ? "\"type\":\"overlap\"," : "", overlaps[i].address, overlaps[i].length, overlaps[i].same ? "true" : "false");
+        if(ndjson) {
+            printf("\n");
+        }
+    }
+    if(!ndjson) {
+        printf("],\"errors\":[");
+    }
+    for(uint32_t i = 0; i < errors->size(); i++) {
+        const hex_error_t* e = &(*errors)[i];
+        printf("%s{%s\"kind\":\"%s\",\"offset\":%u,\"line\":%u,\"column\":%u}", (i && !ndjson) ? sep : "",
+            ndjson ? "\"type\":\"error\"," : "", errorKindName[e->kind], e->offset, e->line, e->column);
+        if(ndjson) {
+            printf("\n");
+        }
+    }
+    if(!ndjson) {
+        printf("],");
+    } else {
+        printf("{\"type\":\"summary\",\"file\":");
+        printJsonString(hexFile);
+        printf(",");
+    }
+    printf("\"records\":%llu,\"record_types\":{", (unsigned long long)info->records);
+    const char* comma = "";
+    for(uint32_t i = 0; i < 256; i++) {
+        if(info->hexTypes[i]) {
+            printf("%s\"%02X\":%llu", comma, i, (unsigned long long)info->hexTypes[i]);
+            comma = ",";
+        }
+    }
+    for(uint32_t i = 0; i < 10; i++) {
+        if(info->srecTypes[i]) {
+            printf("%s\"S%u\":%llu", comma, i, (unsigned long long)info->srecTypes[i]);
+            comma = ",";
+        }
+    }
+    printf("},\"start_address\":");
+    if(info->startValid) {
+        printf("%u", info->startAddress);
+    } else {
+        printf("null");
+    }
+    printf(",\"data_bytes\":%llu,\"payload_bytes\":%llu,\"error_count\":%u,\"fingerprint\":\"%08x\"}\n",
+        (unsigned long long)info->dataBytes, (unsigned long long)image->payloadBytes(), info->errors, digest.fingerprint);
+}
+static void usage(void)
+{
+    printf("stm32_hexinfo [-j jobs] [-o text|json|ndjson] [-s] [HEX FILE]\n");
+    printf("    -j jobs   verify slices of the file in parallel, 0 = all cpus\n");
+    printf("    -o format report format, json and ndjson add a crc32 per segment and a content fingerprint\n");
+    printf("    -s        address map only, data records are not decoded or checksummed (text, single job)\n");
 }
 int main(int argc, char** argv)
 {
-    if(argc <= 1) {
-        printf("stm32_hexinfo [HEX FILE]\n");
+    uint32_t jobs = 1;
+    uint32_t output = HEXINFO_OUTPUT_TEXT;
+    bool summary = false;
+    int opt;
+    while((opt = getopt(argc, argv, "j:o:s")) != -1) {
+        switch(opt) {
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+                if(jobs == 0) {
+                    jobs = std::thread::hardware_concurrency();
+                }
+                if(jobs == 0 || jobs > HEXINFO_MAX_JOBS) {
+                    jobs = HEXINFO_MAX_JOBS;
+                }
+                break;
+            case 'o':
+                if(!strcmp(optarg, "json")) {
+                    output = HEXINFO_OUTPUT_JSON;
+                } else if(!strcmp(optarg, "ndjson")) {
+                    output = HEXINFO_OUTPUT_NDJSON;
+                } else if(strcmp(optarg, "text")) {
+                    usage();
+                    return -1;
+                }
+                break;
+            case 's':
+                summary = true;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if(argc - optind < 1 || (summary && output != HEXINFO_OUTPUT_TEXT)) {
+        usage();
         return -1;
     }
-    const char* hexFile = argv[1];
-    uint8_t* fileBuffer = NULL;
-    uint32_t fileLength = 0;
+    const char* hexFile = argv[optind];
+    hexReader reader;
+    std::vector<hex_chunk_t> chunks;
+    std::vector<hex_error_t> errors;
+    struct hex_info_t info;
+    memImage image;
+    logQuiet = output != HEXINFO_OUTPUT_TEXT;
     LOGD("hex file:%s", hexFile);
-    if(readHexFile(hexFile, &fileBuffer, &fileLength)) {
+    if(!reader.open(hexFile)) {
+        LOGE("open file %s error", hexFile);
         return -1;
     }
-    // printBuffer(fileBuffer, fileLength);
-    parseHexFile(fileBuffer, fileLength);
-    if(fileBuffer) {
-        free(fileBuffer);
+    // printBuffer(reader.data(), reader.size());
+    if(summary) {
+        std::vector<hex_span_t> spans;
+        hex_chunk_t chunk;
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.end = reader.size();
+        chunk.line = 1;
+        chunk.baseKnown = true;
+        chunk.image = new memImage();
+        chunk.errors = new std::vector<hex_error_t>();
+        summarizeHexFile(reader.data(), &chunk, &spans);
+        printSummary(&spans, &chunk.info);
+        LOGD("%llu records, %llu data bytes, %u errors", (unsigned long long)chunk.info.records,
+            (unsigned long long)chunk.info.dataBytes, chunk.info.errors);
+        delete chunk.image;
+        delete chunk.errors;
+        return chunk.info.errors ? -1 : 0;
+    }
+    if(jobs > 1) {
+        parseHexFileParallel(reader.data(), reader.size(), jobs, &chunks);
+    } else {
+        hex_chunk_t chunk;
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.end = reader.size();
+        chunk.line = 1;
+        chunk.baseKnown = true;
+        chunk.image = new memImage();
+        chunk.errors = new std::vector<hex_error_t>();
+        parseHexFile(reader.data(), &chunk);
+        chunks.push_back(chunk);
+    }
+    mergeChunks(&chunks, &info, &image, &errors);
+    if(output == HEXINFO_OUTPUT_TEXT) {
+        printImage(&image);
+        LOGD("%llu records, %llu data bytes, %u errors", (unsigned long long)info.records, (unsigned long long)info.dataBytes, info.errors);
+    } else {
+        printJson(hexFile, &info, &image, &errors, output);
     }
-    return 0;
+    return info.errors ? -1 : 0;
 }
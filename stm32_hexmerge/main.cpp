@@ -2,7 +2,16 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
+#include <cassert>
 #include <vector>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../stm32_bin2hex/hex.h"
+#include "../stm32_bin2hex/memimage.h"
+#include "../stm32_mkimage/crc.h"
+#include "../stm32_mkimage/image.h"
 
 #define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 #define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
@@ -16,11 +25,6 @@ struct hex_data_t {
     uint8_t  data[256];
     uint8_t  chksum;
 };
-struct hex_data_array_t
-{
-    uint8_t* fileBuffer;
-    uint32_t fileLength;
-};
 static int32_t openFile(FILE** fp, const char* fileName)
 {
     if(!fp || !fileName) {
@@ -37,150 +41,710 @@ static int32_t closeFile(FILE** fp)
     if(!fp || !*fp) {
         return -1;
     }
-    fclose(*fp);
-    return 0;
+    int bRet = fclose(*fp);
+    *fp = NULL;
+    return bRet == 0 ? 0 : -1;
+}
+/* drop a failed output, only a regular file: /dev/full or a pipe must stay */
+static void removeFile(const char* fileName)
+{
+    struct stat sbuf;
+    if(stat(fileName, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+        unlink(fileName);
+    }
 }
-static int32_t writeFile(FILE* fp, const char* data)
+static int32_t writeFile(hexWriter* writer, const char* data)
 {
     // LOGD("hex data%s", data);
-    fwrite(data, strlen(data), 1, fp);
+    return writer->write(data, strlen(data)) ? 0 : -1;
+}
+static uint8_t OI(uint8_t c)
+{
+    if('0' <= c && c <= '9') {
+        return c - '0';
+    }
+    if('a' <= c && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if('A' <= c && c <= 'F') {
+        return c - 'A' + 10;
+    }
     return 0;
 }
-static int32_t readHexFile(const char* fileName, uint8_t** buffer, uint32_t* len)
+/*
+ * S1/S2/S3 data is re-encoded as Intel HEX records, header, count and
+ * termination records have no Intel HEX counterpart and are dropped.
+ */
+static int32_t copySRecord(hexWriter* writer, const uint8_t* text, uint32_t len)
 {
-    FILE* fp = NULL;
-    uint32_t n = 0;
-    int32_t bRet = 0;
-    if(!fileName || !strlen(fileName) || !buffer || !len) {
-        LOGE("param error!");
+    struct hexUtils::srec_data_t srec;
+    uint32_t errorOffset = 0;
+    int32_t bRet = hexUtils::decodeSRecord((const char *)text, len, &srec, &errorOffset);
+    if(bRet == hexUtils::HEX_DECODE_BAD_DIGIT) {
+        LOGW("invalid character 0x%02x at column %u, record dropped", text[errorOffset], errorOffset + 1);
+        return 0;
+    }
+    if(bRet) {
+        LOGW("%s record dropped", bRet == hexUtils::HEX_DECODE_CHECKSUM ? "checksum error," : "malformed");
+        return 0;
+    }
+    if(1 <= srec.recordType && srec.recordType <= 3 && !writer->writeData(srec.address, srec.data, srec.recordLen)) {
         return -1;
     }
-    *buffer = NULL;
-    *len    = 0;
+    return 0;
+}
+/* returns -1 if the output could not be written */
+static int32_t copyHexFile(hexWriter* writer, hexReader* reader)
+{
+    bool srecFlag = false;
+    hexReader::record_t record;
+    int32_t bRet = 0;
+    while(reader->next(&record)) {
+        const uint8_t* tmp = record.text;
+        if(tmp[0] == 'S') {
+            if(copySRecord(writer, tmp, record.len)) {
+                bRet = -1;
+            }
+            srecFlag = true;
+            continue;
+        }
+        if(record.len < 9) {
+            LOGW("line %u too short for a record, dropped", record.line);
+            continue;
+        }
+        #define TI(h) (OI(tmp[h]) << 4 | OI(tmp[h + 1]))
+        switch(TI(7)) {
+            case 0:
+            case 2:
+            case 3:
+            case 4:
+                /* copied as is, the line end is always written as CRLF */
+                if(!writer->write((const char *)tmp, record.len) || writeFile(writer, "\x0D\x0A")) {
+                    bRet = -1;
+                }
+                break;
+            case 1: break;
+            case 5: break;
+            default:
+                break;
+        }
+    }
+    if(srecFlag) {
+        /* the next file's records start from segment 0 again */
+        if(writeFile(writer, ":020000040000FA\x0D\x0A")) {
+            bRet = -1;
+        }
+    }
+    return bRet;
+}
+/* how an address given by more than one input is resolved */
+enum {
+    MERGE_POLICY_ERROR = 0,
+    MERGE_POLICY_FIRST,
+    MERGE_POLICY_LAST,
+    MERGE_POLICY_MATCH,
+};
+static const char* mergePolicyName[] = { "error", "first", "last", "match" };
 
-    fp = fopen(fileName, "r");
-    if(!fp) {
-        LOGE("open file %s error", fileName);
+/* populated bytes of one input after it was sorted (normalize mode) */
+struct merge_extent_t {
+    uint32_t address;
+    uint32_t length;
+    const uint8_t* data;
+};
+/*
+ * one input as a source of data in address order, one record of
+ * lookahead: records read from the mapped file (stream mode) or pieces of
+ * its sorted extents (normalize mode), never more than 255 bytes. skip
+ * counts the leading bytes already written or lost to another input,
+ * rank orders the inputs for the overlap policy, lowest wins.
+ * records that do not decode are dropped as in the plain copy, the last
+ * start address record is kept.
+ */
+struct merge_stream_t {
+    hexReader* reader;
+    const std::vector<merge_extent_t>* extents;
+    uint32_t extent;
+    uint32_t extentSkip;
+    uint32_t index;
+    uint32_t rank;
+    hexReader::walk_t walk;
+    uint32_t address;
+    uint32_t len;
+    uint32_t skip;
+    const uint8_t* data;
+    uint8_t  buffer[256];
+};
+static int32_t takeData(void* context, const hexReader::walk_data_t* d)
+{
+    merge_stream_t* stream = (merge_stream_t *)context;
+    stream->address = d->address;
+    stream->len = d->len;
+    memcpy(stream->buffer, d->data, d->len);
+    return 1;
+}
+static bool nextData(merge_stream_t* stream)
+{
+    char error[80];
+    int32_t bRet;
+    while((bRet = stream->reader->walk(&stream->walk, takeData, stream)) < 0) {
+        LOGW("%s, record dropped", hexReader::walkError(&stream->walk, error, sizeof(error)));
+    }
+    return bRet > 0;
+}
+static bool nextPiece(merge_stream_t* stream)
+{
+    if(stream->extent >= stream->extents->size()) {
+        return false;
+    }
+    const merge_extent_t* e = &(*stream->extents)[stream->extent];
+    uint32_t len = e->length - stream->extentSkip;
+    if(len > hexUtils::HEX_RECORD_MAX_LEN) {
+        len = hexUtils::HEX_RECORD_MAX_LEN;
+    }
+    stream->address = e->address + stream->extentSkip;
+    stream->len = len;
+    stream->data = &e->data[stream->extentSkip];
+    stream->extentSkip += len;
+    if(stream->extentSkip == e->length) {
+        stream->extent++;
+        stream->extentSkip = 0;
+    }
+    return true;
+}
+static bool nextRecord(merge_stream_t* stream)
+{
+    stream->skip = 0;
+    stream->data = stream->buffer;
+    if(stream->reader) {
+        return nextData(stream);
+    }
+    return stream->extents ? nextPiece(stream) : false;
+}
+static void initStream(merge_stream_t* stream, uint32_t index, uint32_t rank)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->index = index;
+    stream->rank = rank;
+}
+static void addExtent(void* context, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    std::vector<merge_extent_t>* extents = (std::vector<merge_extent_t> *)context;
+    merge_extent_t extent = { address, len, data };
+    extents->push_back(extent);
+}
+/*
+ * normalize mode: decode the data of a file into image and hand out its
+ * sorted extents, overlaps inside the file are resolved by the image, the
+ * first record wins. returns the number of those with different data.
+ */
+static uint32_t loadHexFile(memImage* image, hexReader* reader, merge_stream_t* stream, std::vector<merge_extent_t>* extents)
+{
+    uint32_t conflicts = 0;
+    stream->reader = reader;
+    while(nextRecord(stream)) {
+        if(!image->add(stream->address, stream->data, stream->len)) {
+            LOGE("data at 0x%08x dropped, out of memory or address space", stream->address);
+        }
+    }
+    stream->reader = NULL;
+    image->finish();
+    const std::vector<memImage::overlap_t>& overlaps = image->overlaps();
+    for(uint32_t i = 0; i < overlaps.size(); i++) {
+        if(!overlaps[i].same) {
+            LOGW("0x%08x - 0x%08x written twice with different data, first one kept",
+                overlaps[i].address, overlaps[i].address + overlaps[i].length - 1);
+            conflicts++;
+        }
+    }
+    image->contents(addExtent, extents);
+    stream->extents = extents;
+    return conflicts;
+}
+/*
+ * a binary input used straight from the mapping, as one extent: a
+ * FILE@address, or a uImage from stm32_mkimage, which goes whole, header
+ * included, to the load address in its header as it is laid out for XIP.
+ * its entry point becomes the input's start address. returns 1 for a
+ * binary, 0 for hex text and -1 if the uImage is corrupt or does not fit.
+ */
+static int32_t loadBinary(hexReader* reader, const char* fileName, bool hasAddress, uint32_t address, merge_stream_t* stream,
+    std::vector<merge_extent_t>* extents)
+{
+    const image_header_t* hdr = (const image_header_t *)reader->data();
+    uint32_t size = reader->size();
+    if(!hasAddress) {
+        if(size < image_get_header_size() || !image_check_magic(hdr)) {
+            return 0;
+        }
+        image_header_t header;
+        memcpy(&header, hdr, sizeof(header));
+        image_set_hcrc(&header, 0);
+        if(crc32(0, (const unsigned char *)&header, sizeof(header)) != image_get_hcrc(hdr)) {
+            LOGE("%s: uImage header checksum error", fileName);
+            return -1;
+        }
+        if(image_get_data_size(hdr) > size - image_get_header_size()) {
+            LOGE("%s: uImage data of %u bytes truncated to %u", fileName, image_get_data_size(hdr),
+                (uint32_t)(size - image_get_header_size()));
+            return -1;
+        }
+        if(crc32_wd(0, (const unsigned char *)image_get_data(hdr), image_get_data_size(hdr), CHUNKSZ_CRC32) != image_get_dcrc(hdr)) {
+            LOGE("%s: uImage data checksum error", fileName);
+            return -1;
+        }
+        address = image_get_load(hdr);
+        size = image_get_image_size(hdr);
+        stream->walk.startValid = true;
+        stream->walk.startAddress = image_get_ep(hdr);
+        LOGD("%s: uImage \"%.*s\", %u bytes at 0x%08x, entry 0x%08x", fileName, IH_NMLEN, (const char *)image_get_name(hdr),
+            size, address, stream->walk.startAddress);
+    }
+    if(address + (uint64_t)size > 0x100000000ULL) {
+        LOGE("file %s does not fit above address 0x%08x", fileName, address);
         return -1;
     }
-    fseek(fp, 0, SEEK_END);
-    *len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if(*len == 0) {
-        LOGE("file %s size is null", fileName);
-        bRet = -1;
-        goto exit;
+    addExtent(extents, address, reader->data(), size);
+    stream->extents = extents;
+    return 1;
+}
+/*
+ * the last bytes written, contiguous up to the output cursor. the cursor
+ * only moves by one record of the source with the lowest next address,
+ * and every other source starts at or above that address, so a source
+ * that falls behind the cursor is at most one record, 255 bytes, back and
+ * its bytes can always be compared against these.
+ */
+struct merge_history_t {
+    uint64_t end;
+    uint32_t len;
+    uint8_t  data[2 * hexUtils::HEX_RECORD_MAX_LEN + 2];
+};
+static void addHistory(merge_history_t* history, uint32_t address, const uint8_t* data, uint32_t len)
+{
+    assert(len <= hexUtils::HEX_RECORD_MAX_LEN);
+    if(address != history->end) {
+        history->len = 0;
     }
-    *buffer = (uint8_t *)malloc(sizeof(uint8_t) * (*len));
-    if(!(*buffer)) {
-        LOGE("malloc file %d buffer failed", (int32_t)(sizeof(uint8_t) * (*len)));
-        bRet = -1;
-        goto exit;
+    if(history->len + len > sizeof(history->data)) {
+        uint32_t keep = hexUtils::HEX_RECORD_MAX_LEN;
+        memmove(history->data, &history->data[history->len - keep], keep);
+        history->len = keep;
     }
-
-    n = fread(*buffer, sizeof(unsigned char), *len, fp);
-    if(n == 0) {
-        LOGE("read file %s error", fileName);
-        bRet = -1;
-        goto exit;
+    memcpy(&history->data[history->len], data, len);
+    history->len += len;
+    history->end = (uint64_t)address + len;
+}
+/* min-heap on the next unwritten address, the winning input first for equal ones */
+static bool streamAfter(const merge_stream_t* a, const merge_stream_t* b)
+{
+    uint64_t as = (uint64_t)a->address + a->skip;
+    uint64_t bs = (uint64_t)b->address + b->skip;
+    return as != bs ? as > bs : a->rank > b->rank;
+}
+/* provenance: which input supplied an output range, appended in address order */
+struct merge_origin_t {
+    uint32_t address;
+    uint64_t end;
+    uint32_t index;
+};
+/* an overlap being reported, touching ones between the same two inputs are joined */
+struct merge_report_t {
+    bool     pending;
+    bool     same;
+    uint32_t loser;
+    uint32_t winner;
+    uint32_t address;
+    uint64_t end;
+};
+struct merge_state_t {
+    std::vector<merge_stream_t*> heap;
+    merge_history_t history;
+    std::vector<merge_origin_t> origins;
+    merge_report_t report;
+    uint8_t  policy;
+    uint32_t failures;
+    uint64_t overlapBytes;
+    uint64_t conflictBytes;
+};
+static void addOrigin(merge_state_t* state, uint32_t address, uint32_t len, uint32_t index)
+{
+    std::vector<merge_origin_t>* origins = &state->origins;
+    if(!origins->empty() && origins->back().end == address && origins->back().index == index) {
+        origins->back().end += len;
+        return;
     }
-    if(n != (*len)) {
-        LOGE("read file %s fail, fileLen %d, readLen %d", fileName, (int32_t)*len, (int32_t)n);
-        bRet = -1;
-        goto exit;
+    merge_origin_t origin = { address, (uint64_t)address + len, index };
+    origins->push_back(origin);
+}
+static bool originLess(uint32_t address, const merge_origin_t& origin)
+{
+    return address < origin.address;
+}
+static void flushReport(merge_state_t* state, char** files)
+{
+    const merge_report_t* r = &state->report;
+    if(!r->pending) {
+        return;
     }
-    fclose(fp);
-    return 0;
-exit:
-    if(fp) {
-        fclose(fp);
+    state->report.pending = false;
+    if(state->policy == MERGE_POLICY_ERROR) {
+        LOGE("%s: 0x%08x - 0x%08x overlaps %s", files[r->loser], r->address, (uint32_t)(r->end - 1), files[r->winner]);
+        state->failures++;
+    } else if(r->same) {
+        return;
+    } else if(state->policy == MERGE_POLICY_MATCH) {
+        LOGE("%s: 0x%08x - 0x%08x differs from %s", files[r->loser], r->address, (uint32_t)(r->end - 1), files[r->winner]);
+        state->failures++;
+    } else {
+        LOGW("%s: 0x%08x - 0x%08x differs from %s, %s kept", files[r->loser], r->address, (uint32_t)(r->end - 1),
+            files[r->winner], files[r->winner]);
     }
-    if(*buffer) {
-        free(*buffer);
+}
+static void addReport(merge_state_t* state, uint32_t loser, uint32_t winner, bool same, uint32_t address, uint32_t len, char** files)
+{
+    merge_report_t* r = &state->report;
+    /* under error any overlap fails, equal and different bytes make one range */
+    bool joinable = r->same == same || state->policy == MERGE_POLICY_ERROR;
+    if(r->pending && r->loser == loser && r->winner == winner && joinable && r->end == address) {
+        r->end += len;
+        return;
     }
-    *buffer = NULL;
-    *len    = 0;
-    return bRet;
+    flushReport(state, files);
+    r->pending = true;
+    r->same = same;
+    r->loser = loser;
+    r->winner = winner;
+    r->address = address;
+    r->end = (uint64_t)address + len;
 }
-static uint8_t OI(uint8_t c)
+/*
+ * the bytes of an overtaken source at [start, end) were written before,
+ * every input that supplied them is looked up in the provenance map and
+ * its piece split into runs of equal and different bytes, then the policy
+ * decides. only the different ones count as conflicts.
+ */
+static void checkOverlap(merge_state_t* state, const merge_stream_t* s, uint64_t start, uint64_t end, char** files)
 {
-    if('0' <= c && c <= '9') {
-        return c - '0';
+    const merge_history_t* history = &state->history;
+    std::vector<merge_origin_t>::const_iterator o =
+        std::upper_bound(state->origins.begin(), state->origins.end(), (uint32_t)start, originLess);
+    if(o != state->origins.begin()) {
+        o--;
     }
-    if('a' <= c && c <= 'f') {
-        return c - 'a' + 10;
+    for(; o != state->origins.end() && o->address < end; o++) {
+        uint64_t from = o->address > start ? o->address : start;
+        uint64_t to = o->end < end ? o->end : end;
+        uint32_t n = to - from;
+        uint32_t back = history->end - from;
+        state->overlapBytes += n;
+        assert(back <= history->len);
+        const uint8_t* kept = &history->data[history->len - back];
+        const uint8_t* data = &s->data[s->skip + (from - start)];
+        for(uint32_t pos = 0; pos < n; ) {
+            uint32_t len = hexUtils::spanEqual(&kept[pos], &data[pos], n - pos);
+            bool same = len != 0;
+            if(!same) {
+                len = hexUtils::spanDiffer(&kept[pos], &data[pos], n - pos);
+                state->conflictBytes += len;
+            }
+            addReport(state, s->index, o->index, same, from + pos, len, files);
+            pos += len;
+        }
     }
-    if('A' <= c && c <= 'F') {
-        return c - 'A' + 10;
+}
+static bool pushStream(merge_state_t* state, merge_stream_t* stream, char** files)
+{
+    uint32_t previous = stream->address;
+    if(!nextRecord(stream)) {
+        return true;
     }
-    return 0;
+    if(stream->reader && stream->address < previous) {
+        LOGE("%s: record at 0x%08x follows 0x%08x, the file is not in address order, merge it with -n",
+            files[stream->index], stream->address, previous);
+        return false;
+    }
+    state->heap.push_back(stream);
+    std::push_heap(state->heap.begin(), state->heap.end(), streamAfter);
+    return true;
 }
-static void copyHexFile(FILE* fp, const struct hex_data_array_t* data)
-{
-    uint8_t recordType = 0xFF;
-    bool hexStartFlag = false;
-    uint8_t tmp[512] = { 0 };
-    uint32_t index = 0;
-    for(uint32_t i = 0; i < data->fileLength; i++) {
-        if(data->fileBuffer[i] == ':') {
-            hexStartFlag = true;
-            recordType = 0xFF;
-            memset(tmp, 0, sizeof(tmp));
-            index = 0;
-        }
-        if(hexStartFlag) {
-            tmp[index++] = data->fileBuffer[i];
-        }
-        if(data->fileBuffer[i] == 0x0A && data->fileBuffer[i - 1] == 0x0D) {
-            hexStartFlag = false;
-            #define TI(h) (OI(tmp[h]) << 4 | OI(tmp[h + 1]))
-            recordType = TI(7);
-            switch(recordType) {
-                case 0: writeFile(fp, (const char *)tmp); break;
-                case 1: break;
-                case 2: writeFile(fp, (const char *)tmp); break;
-                case 3: writeFile(fp, (const char *)tmp); break;
-                case 4: writeFile(fp, (const char *)tmp); break;
-                case 5: break;
-                default:
-                    break;
+/*
+ * k-way merge of the sources through a heap keyed on their next unwritten
+ * address, which is the interval index over all inputs: the source on top
+ * writes until its record ends or the next source starts, so the winning
+ * input always supplies the bytes it has and one reaching the same
+ * address loses them and is checked against what was written instead.
+ * O(n log k) for n records from k inputs, only k records, the history and
+ * the provenance map are held, whatever the size of the inputs.
+ */
+static int32_t mergeStreams(hexWriter* writer, std::vector<merge_stream_t>* streams, char** files, uint8_t policy, bool provenance)
+{
+    merge_state_t state;
+    memset(&state.history, 0, sizeof(state.history));
+    memset(&state.report, 0, sizeof(state.report));
+    state.policy = policy;
+    state.failures = 0;
+    state.overlapBytes = 0;
+    state.conflictBytes = 0;
+    for(uint32_t i = 0; i < streams->size(); i++) {
+        (*streams)[i].address = 0;
+        if(!pushStream(&state, &(*streams)[i], files)) {
+            return -1;
+        }
+    }
+    while(!state.heap.empty()) {
+        std::pop_heap(state.heap.begin(), state.heap.end(), streamAfter);
+        merge_stream_t* s = state.heap.back();
+        state.heap.pop_back();
+        uint64_t start = (uint64_t)s->address + s->skip;
+        uint64_t end = (uint64_t)s->address + s->len;
+        merge_history_t* history = &state.history;
+        if(start < history->end) {
+            /* overtaken: check what it has below the cursor and drop it */
+            uint64_t overlapEnd = end < history->end ? end : history->end;
+            checkOverlap(&state, s, start, overlapEnd, files);
+            s->skip += overlapEnd - start;
+        } else {
+            /* write up to where the next source starts, it may be an earlier input */
+            uint64_t limit = end;
+            std::vector<merge_stream_t*> ties;
+            while(!state.heap.empty() && (uint64_t)state.heap.front()->address + state.heap.front()->skip == start) {
+                std::pop_heap(state.heap.begin(), state.heap.end(), streamAfter);
+                ties.push_back(state.heap.back());
+                state.heap.pop_back();
+            }
+            if(!state.heap.empty()) {
+                uint64_t next = (uint64_t)state.heap.front()->address + state.heap.front()->skip;
+                limit = next < limit ? next : limit;
+            }
+            for(uint32_t i = 0; i < ties.size(); i++) {
+                state.heap.push_back(ties[i]);
+                std::push_heap(state.heap.begin(), state.heap.end(), streamAfter);
+            }
+            uint32_t n = limit - start;
+            if(!writer->writeData(start, &s->data[s->skip], n)) {
+                LOGE("write data at 0x%08x error", (uint32_t)start);
+                return -1;
             }
+            addHistory(history, start, &s->data[s->skip], n);
+            addOrigin(&state, start, n, s->index);
+            s->skip += n;
+        }
+        if(s->skip < s->len) {
+            state.heap.push_back(s);
+            std::push_heap(state.heap.begin(), state.heap.end(), streamAfter);
+        } else if(!pushStream(&state, s, files)) {
+            return -1;
+        }
+    }
+    flushReport(&state, files);
+    if(state.overlapBytes) {
+        LOGD("%llu bytes overlapped, %llu with different data", (unsigned long long)state.overlapBytes, (unsigned long long)state.conflictBytes);
+    }
+    if(provenance) {
+        for(uint32_t i = 0; i < state.origins.size(); i++) {
+            const merge_origin_t* o = &state.origins[i];
+            LOGD("0x%08x - 0x%08x, %llu bytes from %s", o->address, (uint32_t)(o->end - 1),
+                (unsigned long long)(o->end - o->address), files[o->index]);
         }
     }
+    if(state.failures) {
+        LOGE("%u overlaps violate the %s policy", state.failures, mergePolicyName[policy]);
+        return -1;
+    }
+    for(uint32_t i = streams->size(); i-- > 0;) {
+        if((*streams)[i].walk.startValid) {
+            writer->setStartAddress((*streams)[i].walk.startAddress);
+            break;
+        }
+    }
+    return 0;
+}
+static void usage(void)
+{
+    printf("stm32_hexmerge [-n | -s] [-w width] [-p policy] [-P] [OUTPUT FILE] [HEX FILE | BIN FILE@address | UIMAGE]...\n");
+    printf("    binaries are encoded into the output directly, a uImage goes whole to the load address in its header\n");
+    printf("    -n        normalize: sort every input and merge them into new records, earlier inputs win overlaps\n");
+    printf("    -s        stream: like -n for inputs already in address order, in flat memory\n");
+    printf("    -w width  data bytes per record when normalizing, %d..%d (default %d), implies -n without -s\n",
+        hexUtils::HEX_RECORD_MIN_LEN, hexUtils::HEX_RECORD_MAX_LEN, hexUtils::HEX_RECORD_DEFAULT_LEN);
+    printf("    -p policy for addresses given by more than one input, implies -n without -s:\n");
+    printf("              first  the earlier input wins, differences are warned about (default)\n");
+    printf("              last   the later input wins, differences are warned about\n");
+    printf("              match  overlaps must hold the same data\n");
+    printf("              error  no overlaps allowed\n");
+    printf("              a violation fails the merge and removes the output\n");
+    printf("    -P        print which input supplied each output range, implies -n without -s\n");
 }
 int main(int argc, char** argv)
 {
-    if(argc <= 2) {
-        printf("stm32_hexmerge [OUTPUT FILE] [HEX FILE]...\n");
+    bool normalize = false;
+    bool stream = false;
+    bool hasWidth = false;
+    bool hasPolicy = false;
+    bool provenance = false;
+    uint8_t policy = MERGE_POLICY_FIRST;
+    uint32_t conflicts = 0;
+    uint32_t recordLen = hexUtils::HEX_RECORD_DEFAULT_LEN;
+    int32_t bRet = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "nsw:p:P")) != -1) {
+        switch(opt) {
+            case 'n':
+                normalize = true;
+                break;
+            case 's':
+                stream = true;
+                break;
+            case 'w':
+                hasWidth = true;
+                recordLen = strtoul(optarg, NULL, 0);
+                if(recordLen < hexUtils::HEX_RECORD_MIN_LEN || recordLen > hexUtils::HEX_RECORD_MAX_LEN) {
+                    LOGE("record width %s out of range", optarg);
+                    return -1;
+                }
+                break;
+            case 'p':
+                for(policy = 0; policy < sizeof(mergePolicyName) / sizeof(mergePolicyName[0]); policy++) {
+                    if(!strcmp(optarg, mergePolicyName[policy])) {
+                        break;
+                    }
+                }
+                if(policy == sizeof(mergePolicyName) / sizeof(mergePolicyName[0])) {
+                    usage();
+                    return -1;
+                }
+                hasPolicy = true;
+                break;
+            case 'P':
+                provenance = true;
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if(argc - optind < 2 || (normalize && stream)) {
+        usage();
         return -1;
     }
+    if((hasWidth || hasPolicy || provenance) && !stream) {
+        normalize = true;
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
     FILE* outputFile = NULL;
     char* hexFile = NULL;
-    struct hex_data_array_t hexData;
-    std::vector<struct hex_data_array_t> hexArray;
-    hexArray.clear();
-    if(openFile(&outputFile, argv[1]) != 0) {
-        return -1;
-    }
-    for(uint32_t i = 2; i < argc; i++) {
-        hexFile = argv[i];
+    uint32_t count = argc - 2;
+    std::vector<hexReader*> readers(count, (hexReader *)NULL);
+    std::vector<memImage*> images(count, (memImage *)NULL);
+    std::vector<std::vector<merge_extent_t> > extents(count);
+    std::vector<merge_stream_t> streams(count);
+    /* every input is opened and checked first, a bad one must not cost an existing output */
+    for(uint32_t i = 0; i < count; i++) {
+        bool hasAddress = false;
+        uint32_t address = 0;
+        int32_t binary;
+        hexFile = argv[2 + i];
+        readers[i] = new hexReader();
+        initStream(&streams[i], i, policy == MERGE_POLICY_LAST ? count - 1 - i : i);
+        /* FILE@address places a raw binary, the address is hex */
+        if(hexUtils::parseFileAddress(hexFile, &hasAddress, &address)) {
+            LOGE("invalid address in %s", hexFile);
+            bRet = -1;
+            continue;
+        }
         LOGD("hex file:%s", hexFile);
-        if(readHexFile(hexFile, &hexData.fileBuffer, &hexData.fileLength)) {
+        if(!readers[i]->open(hexFile)) {
+            LOGE("open file %s error", hexFile);
             LOGW("error hex file!");
             continue;
         }
-        hexArray.push_back(hexData);
+        binary = loadBinary(readers[i], hexFile, hasAddress, address, &streams[i], &extents[i]);
+        if(binary < 0) {
+            bRet = -1;
+            continue;
+        }
+        if(binary) {
+            continue;
+        }
+        if(stream) {
+            /* every input stays mapped and is read as the merge goes */
+            streams[i].reader = readers[i];
+            readers[i]->dropConsumed(true);
+        } else if(normalize) {
+            images[i] = new memImage();
+            conflicts += loadHexFile(images[i], readers[i], &streams[i], &extents[i]);
+            readers[i]->close();
+        }
+    }
+    if(conflicts && (policy == MERGE_POLICY_ERROR || policy == MERGE_POLICY_MATCH)) {
+        LOGE("%u overlaps with different data inside the inputs violate the %s policy", conflicts, mergePolicyName[policy]);
+        bRet = -1;
+    }
+    if(bRet == 0 && openFile(&outputFile, argv[1]) != 0) {
+        LOGE("open file %s error", argv[1]);
+        bRet = -1;
     }
-    
-    for(uint32_t i = 0; i < hexArray.size(); i++) {
-        copyHexFile(outputFile, &hexArray[i]);
-        if(hexArray[i].fileBuffer) {
-            free(hexArray[i].fileBuffer);
+    if(bRet) {
+        for(uint32_t i = 0; i < count; i++) {
+            delete readers[i];
+            delete images[i];
         }
+        return bRet;
     }
-    const char* hexEndOfLine = ":00000001FF\x0D\x0A";
-    writeFile(outputFile, hexEndOfLine);
-    closeFile(&outputFile);
-    hexArray.clear();
-    return 0;
+    {
+        hexWriter writer(outputFile);
+        if(!writer.valid()) {
+            LOGE("malloc output buffer failed");
+            bRet = -1;
+        }
+        writer.setRecordLen(recordLen);
+        if(bRet == 0 && (stream || normalize)) {
+            if(mergeStreams(&writer, &streams, &argv[2], policy, provenance)) {
+                bRet = -1;
+            }
+            if(bRet == 0 && !writer.writeEndOfFile()) {
+                LOGE("write %s error", argv[1]);
+                bRet = -1;
+            }
+        } else if(bRet == 0) {
+            for(uint32_t i = 0; i < count; i++) {
+                if(!extents[i].empty()) {
+                    /* encoded in place, the next file's records start from segment 0 again */
+                    const merge_extent_t* e = &extents[i][0];
+                    if(!writer.writeData(e->address, e->data, e->length) || writeFile(&writer, ":020000040000FA\x0D\x0A")) {
+                        LOGE("write %s error", argv[1]);
+                        bRet = -1;
+                    }
+                } else if(readers[i]->data() && copyHexFile(&writer, readers[i])) {
+                    LOGE("write %s error", argv[1]);
+                    bRet = -1;
+                }
+                readers[i]->close();
+            }
+            const char* hexEndOfLine = ":00000001FF\x0D\x0A";
+            if(writeFile(&writer, hexEndOfLine)) {
+                LOGE("write %s error", argv[1]);
+                bRet = -1;
+            }
+        }
+        if(bRet == 0 && !writer.flush()) {
+            LOGE("write %s error", argv[1]);
+            bRet = -1;
+        }
+    }
+    if(closeFile(&outputFile)) {
+        LOGE("close file %s error", argv[1]);
+        bRet = -1;
+    }
+    if(bRet) {
+        /* a half merged image must not reach the programmer */
+        removeFile(argv[1]);
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        delete readers[i];
+        delete images[i];
+    }
+    return bRet;
 }
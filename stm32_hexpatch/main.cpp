@@ -0,0 +1,564 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "../stm32_bin2hex/hex.h"
+
+#define LOGD(fmt, ...) printf("[DEBUG][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGW(fmt, ...) printf("[WARNING][%s]" fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LOGE(fmt, ...) printf("[ERROR][%s]"   fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+
+#define HEXPATCH_MAX_IOV        1024
+
+/*
+ * data record of the template: where its text is in the mapping and what
+ * it holds, decoded once. type is 0 for Intel HEX, the S-record type else.
+ */
+struct patch_record_t {
+    uint32_t address;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t textLen;
+    uint32_t data;
+    uint16_t loadOffset;
+    uint8_t  type;
+};
+struct patch_template_t {
+    hexReader reader;
+    std::vector<patch_record_t> records;
+    std::vector<uint8_t> data;
+};
+/* bytes to put at address in one image, data indexes device_t::bytes */
+struct patch_t {
+    uint32_t address;
+    uint32_t length;
+    uint32_t data;
+};
+struct device_t {
+    std::string fileName;
+    uint32_t line;
+    std::vector<patch_t> patches;
+    std::vector<uint8_t> bytes;
+};
+/* a record of the template replaced in one image, text is its new encoding */
+struct patch_edit_t {
+    uint32_t record;
+    uint32_t offset;
+    uint32_t textLen;
+    uint8_t  data[256];
+    char     text[4 + 2 * (4 + 255 + 1) + 2];
+};
+
+static bool recordLess(const patch_record_t& a, const patch_record_t& b)
+{
+    return a.address < b.address;
+}
+static bool recordAfter(uint32_t address, const patch_record_t& record)
+{
+    return address < record.address;
+}
+static bool patchLess(const patch_t& a, const patch_t& b)
+{
+    return a.address < b.address;
+}
+static bool editLess(const patch_edit_t& a, const patch_edit_t& b)
+{
+    return a.offset < b.offset;
+}
+static bool deviceLess(const device_t* a, const device_t* b)
+{
+    return a->fileName != b->fileName ? a->fileName < b->fileName : a->line < b->line;
+}
+static int32_t addRecord(void* context, const hexReader::walk_data_t* d)
+{
+    patch_template_t* t = (patch_template_t *)context;
+    patch_record_t r;
+    r.address = d->address;
+    r.length = d->len;
+    r.offset = d->record->offset;
+    r.textLen = d->record->len;
+    r.data = t->data.size();
+    r.loadOffset = d->loadOffset;
+    r.type = d->type;
+    t->data.insert(t->data.end(), d->data, d->data + d->len);
+    t->records.push_back(r);
+    return 0;
+}
+/*
+ * index the data records of the template by address. every record has to
+ * decode and no two may overlap, a patched byte must have a single home.
+ */
+static int32_t loadTemplate(patch_template_t* t, const char* fileName)
+{
+    hexReader::walk_t walk;
+    char error[80];
+    if(!t->reader.open(fileName)) {
+        LOGE("open file %s error", fileName);
+        return -1;
+    }
+    memset(&walk, 0, sizeof(walk));
+    if(t->reader.walk(&walk, addRecord, t)) {
+        LOGE("%s: %s", fileName, hexReader::walkError(&walk, error, sizeof(error)));
+        return -1;
+    }
+    /* records stay numbered in file order through their text offset */
+    std::stable_sort(t->records.begin(), t->records.end(), recordLess);
+    for(uint32_t i = 1; i < t->records.size(); i++) {
+        const patch_record_t* a = &t->records[i - 1];
+        if((uint64_t)a->address + a->length > t->records[i].address) {
+            LOGE("%s: records at 0x%08x and 0x%08x overlap, a patch could not tell which to change", fileName,
+                a->address, t->records[i].address);
+            return -1;
+        }
+    }
+    return 0;
+}
+static bool parseAddress(const char* text, uint32_t len, uint32_t* address)
+{
+    uint64_t value = 0;
+    if(len > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        text += 2;
+        len -= 2;
+    }
+    if(!len || len > 8) {
+        return false;
+    }
+    for(uint32_t i = 0; i < len; i++) {
+        uint8_t v = hexUtils::hexNibble[(uint8_t)text[i]];
+        if(v > 15) {
+            return false;
+        }
+        value = value << 4 | v;
+    }
+    *address = value;
+    return true;
+}
+/* a hex digit string as the bytes to put at address, empty means no patch */
+static bool addPatch(device_t* device, uint32_t address, const char* text, uint32_t len)
+{
+    uint8_t sum = 0;
+    if(!len) {
+        return true;
+    }
+    if(len & 1 || (uint64_t)address + len / 2 > 0x100000000ULL) {
+        return false;
+    }
+    patch_t patch = { address, len / 2, (uint32_t)device->bytes.size() };
+    device->bytes.resize(device->bytes.size() + len / 2);
+    if(hexUtils::decodeHexBytes(text, len / 2, &device->bytes[patch.data], &sum) != len) {
+        return false;
+    }
+    device->patches.push_back(patch);
+    return true;
+}
+static void trim(const char** text, uint32_t* len)
+{
+    while(*len && (**text == ' ' || **text == '\t')) {
+        (*text)++;
+        (*len)--;
+    }
+    while(*len && ((*text)[*len - 1] == ' ' || (*text)[*len - 1] == '\t')) {
+        (*len)--;
+    }
+}
+/*
+ * CSV: the header names the patch addresses after a first column for the
+ * output file, every row is one image, "file,0x08007f00,0x08007f10" then
+ * "unit0001.hex,30303031,0080e1000001". no quoting, an empty cell leaves
+ * the template as it is.
+ */
+static int32_t parseCsvLine(const char* text, uint32_t len, uint32_t line, std::vector<uint32_t>* columns, std::vector<device_t>* devices)
+{
+    device_t device;
+    uint32_t column = 0;
+    device.line = line;
+    while(true) {
+        const char* comma = (const char *)memchr(text, ',', len);
+        const char* cell = text;
+        uint32_t cellLen = comma ? comma - text : len;
+        trim(&cell, &cellLen);
+        if(column == 0) {
+            device.fileName.assign(cell, cellLen);
+        } else if(column > columns->size()) {
+            LOGE("line %u: more cells than addresses in the header", line);
+            return -1;
+        } else if(!addPatch(&device, (*columns)[column - 1], cell, cellLen)) {
+            LOGE("line %u, column %u: invalid hex data", line, column + 1);
+            return -1;
+        }
+        column++;
+        if(!comma) {
+            break;
+        }
+        len -= comma + 1 - text;
+        text = comma + 1;
+    }
+    if(device.fileName.empty()) {
+        LOGE("line %u: no output file", line);
+        return -1;
+    }
+    devices->push_back(device);
+    return 0;
+}
+static int32_t parseCsvHeader(const char* text, uint32_t len, uint32_t line, std::vector<uint32_t>* columns)
+{
+    const char* comma = (const char *)memchr(text, ',', len);
+    while(comma) {
+        len -= comma + 1 - text;
+        text = comma + 1;
+        comma = (const char *)memchr(text, ',', len);
+        const char* cell = text;
+        uint32_t cellLen = comma ? comma - text : len;
+        uint32_t address;
+        trim(&cell, &cellLen);
+        if(!parseAddress(cell, cellLen, &address)) {
+            LOGE("line %u: header cell \"%.*s\" is no address", line, (int)cellLen, cell);
+            return -1;
+        }
+        columns->push_back(address);
+    }
+    if(columns->empty()) {
+        LOGE("line %u: the header has no patch addresses", line);
+        return -1;
+    }
+    return 0;
+}
+/* a JSON string without escapes, the text after the closing quote goes to end */
+static bool parseJsonString(const char* text, const char* last, const char** value, uint32_t* len, const char** end)
+{
+    if(text >= last || *text != '"') {
+        return false;
+    }
+    const char* quote = (const char *)memchr(text + 1, '"', last - text - 1);
+    if(!quote || memchr(text + 1, '\\', quote - text - 1)) {
+        return false;
+    }
+    *value = text + 1;
+    *len = quote - text - 1;
+    *end = quote + 1;
+    return true;
+}
+static const char* skipSpace(const char* text, const char* last)
+{
+    while(text < last && (*text == ' ' || *text == '\t')) {
+        text++;
+    }
+    return text;
+}
+/*
+ * NDJSON: one flat object per image, the output file under "file" and the
+ * bytes for every address as a hex string,
+ * {"file":"unit0001.hex","0x08007f00":"30303031"}
+ */
+static int32_t parseJsonLine(const char* text, uint32_t len, uint32_t line, std::vector<device_t>* devices)
+{
+    const char* last = text + len;
+    device_t device;
+    device.line = line;
+    text = skipSpace(text, last);
+    if(text == last || *text++ != '{') {
+        goto error;
+    }
+    text = skipSpace(text, last);
+    while(text < last && *text != '}') {
+        const char* key;
+        const char* value;
+        uint32_t keyLen, valueLen;
+        uint32_t address;
+        if(!parseJsonString(text, last, &key, &keyLen, &text)) {
+            goto error;
+        }
+        text = skipSpace(text, last);
+        if(text == last || *text++ != ':') {
+            goto error;
+        }
+        text = skipSpace(text, last);
+        if(!parseJsonString(text, last, &value, &valueLen, &text)) {
+            goto error;
+        }
+        if(keyLen == 4 && !memcmp(key, "file", 4)) {
+            device.fileName.assign(value, valueLen);
+        } else if(!parseAddress(key, keyLen, &address)) {
+            LOGE("line %u: key \"%.*s\" is no address", line, (int)keyLen, key);
+            return -1;
+        } else if(!addPatch(&device, address, value, valueLen)) {
+            LOGE("line %u: invalid hex data for 0x%08x", line, address);
+            return -1;
+        }
+        /* members are separated by commas, the last one is followed by the closing brace */
+        text = skipSpace(text, last);
+        if(text < last && *text == ',') {
+            text = skipSpace(text + 1, last);
+            if(text < last && *text == '}') {
+                goto error;
+            }
+        } else if(text < last && *text != '}') {
+            goto error;
+        }
+    }
+    if(text == last || skipSpace(text + 1, last) != last) {
+        goto error;
+    }
+    if(device.fileName.empty()) {
+        LOGE("line %u: no \"file\" for the output", line);
+        return -1;
+    }
+    devices->push_back(device);
+    return 0;
+error:
+    LOGE("line %u: not a flat JSON object of strings", line);
+    return -1;
+}
+/* CSV or NDJSON, told apart by the first character of the first line */
+static int32_t loadPatches(const char* fileName, std::vector<device_t>* devices)
+{
+    hexReader reader;
+    std::vector<uint32_t> columns;
+    bool json = false;
+    if(!reader.open(fileName)) {
+        LOGE("open file %s error", fileName);
+        return -1;
+    }
+    const char* text = (const char *)reader.data();
+    const char* last = text + reader.size();
+    uint32_t line = 0;
+    while(text < last) {
+        const char* lf = (const char *)memchr(text, '\n', last - text);
+        uint32_t len = lf ? lf - text : last - text;
+        const char* next = lf ? lf + 1 : last;
+        line++;
+        if(len && text[len - 1] == '\r') {
+            len--;
+        }
+        trim(&text, &len);
+        if(!len) {
+            text = next;
+            continue;
+        }
+        if(devices->empty() && columns.empty() && !json) {
+            json = text[0] == '{';
+            if(!json) {
+                if(parseCsvHeader(text, len, line, &columns)) {
+                    return -1;
+                }
+                text = next;
+                continue;
+            }
+        }
+        if(json ? parseJsonLine(text, len, line, devices) : parseCsvLine(text, len, line, &columns, devices)) {
+            return -1;
+        }
+        text = next;
+    }
+    /* two rows for one output would silently lose the first image */
+    std::vector<const device_t*> sorted(devices->size());
+    for(uint32_t i = 0; i < devices->size(); i++) {
+        sorted[i] = &(*devices)[i];
+    }
+    std::sort(sorted.begin(), sorted.end(), deviceLess);
+    for(uint32_t i = 1; i < sorted.size(); i++) {
+        if(sorted[i]->fileName == sorted[i - 1]->fileName) {
+            LOGE("line %u: output %s is already written by line %u", sorted[i]->line, sorted[i]->fileName.c_str(), sorted[i - 1]->line);
+            return -1;
+        }
+    }
+    return 0;
+}
+/*
+ * the records a device's patches fall into get the new bytes and are
+ * encoded again, checksum included. patches are sorted and may not
+ * overlap, so each one costs a binary search and the records they touch
+ * are met in address order, one edit per record. the edits are then put
+ * in file order for the copy.
+ */
+static int32_t editRecords(const patch_template_t* t, device_t* device, std::vector<patch_edit_t>* edits)
+{
+    const std::vector<patch_record_t>& records = t->records;
+    edits->clear();
+    std::sort(device->patches.begin(), device->patches.end(), patchLess);
+    for(uint32_t i = 0; i < device->patches.size(); i++) {
+        const patch_t* p = &device->patches[i];
+        uint64_t address = p->address;
+        uint64_t end = (uint64_t)p->address + p->length;
+        if(i && (uint64_t)device->patches[i - 1].address + device->patches[i - 1].length > address) {
+            LOGE("line %u: patches at 0x%08x and 0x%08x overlap", device->line, device->patches[i - 1].address, p->address);
+            return -1;
+        }
+        uint32_t k = std::upper_bound(records.begin(), records.end(), p->address, recordAfter) - records.begin();
+        k = k ? k - 1 : 0;
+        while(address < end) {
+            if(k == records.size() || records[k].address > address || (uint64_t)records[k].address + records[k].length <= address) {
+                LOGE("line %u: 0x%08x is not in the template", device->line, (uint32_t)address);
+                return -1;
+            }
+            const patch_record_t* r = &records[k];
+            uint64_t recordEnd = (uint64_t)r->address + r->length;
+            uint32_t n = (end < recordEnd ? end : recordEnd) - address;
+            if(edits->empty() || edits->back().record != k) {
+                edits->resize(edits->size() + 1);
+                patch_edit_t* edit = &edits->back();
+                edit->record = k;
+                edit->offset = r->offset;
+                memcpy(edit->data, &t->data[r->data], r->length);
+            }
+            memcpy(&edits->back().data[address - r->address], &device->bytes[p->data + (address - p->address)], n);
+            address += n;
+            k++;
+        }
+    }
+    for(uint32_t i = 0; i < edits->size(); i++) {
+        patch_edit_t* edit = &(*edits)[i];
+        const patch_record_t* r = &records[edit->record];
+        if(r->type) {
+            edit->textLen = hexUtils::encodeSRecord(r->type, r->address, edit->data, r->length, edit->text);
+        } else {
+            edit->textLen = hexUtils::encodeHexRecord(hexUtils::HEX_RECORD_DATA, r->loadOffset, edit->data, r->length, edit->text);
+        }
+        /* the template's own line end follows the record */
+        edit->textLen -= 2;
+    }
+    std::sort(edits->begin(), edits->end(), editLess);
+    return 0;
+}
+/*
+ * the template text with the edited records spliced in, gathered into one
+ * writev per IOV_MAX spans. it goes to a temporary file next to fileName
+ * that is renamed over it at the end, a failure leaves fileName as it was.
+ */
+static int32_t writeImage(const patch_template_t* t, const std::vector<patch_edit_t>* edits, const char* fileName)
+{
+    struct iovec iov[HEXPATCH_MAX_IOV];
+    const uint8_t* text = t->reader.data();
+    std::string tmpName = fileName;
+    uint32_t pos = 0;
+    uint32_t n = 0;
+    int32_t bRet = 0;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    tmpName += suffix;
+    int fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if(fd < 0) {
+        LOGE("open file %s error", tmpName.c_str());
+        return -1;
+    }
+    for(uint32_t i = 0; i <= edits->size() && !bRet; i++) {
+        const patch_edit_t* edit = i < edits->size() ? &(*edits)[i] : NULL;
+        uint32_t upto = edit ? edit->offset : t->reader.size();
+        iov[n].iov_base = (void *)&text[pos];
+        iov[n].iov_len = upto - pos;
+        n++;
+        if(edit) {
+            iov[n].iov_base = (void *)edit->text;
+            iov[n].iov_len = edit->textLen;
+            n++;
+            pos = upto + t->records[edit->record].textLen;
+        }
+        if(n + 2 > HEXPATCH_MAX_IOV || !edit) {
+            size_t len = 0;
+            for(uint32_t j = 0; j < n; j++) {
+                len += iov[j].iov_len;
+            }
+            if(writev(fd, iov, n) != (ssize_t)len) {
+                LOGE("write %s error", fileName);
+                bRet = -1;
+            }
+            n = 0;
+        }
+    }
+    if(close(fd) < 0) {
+        LOGE("close file %s error", tmpName.c_str());
+        bRet = -1;
+    }
+    if(bRet == 0 && rename(tmpName.c_str(), fileName) < 0) {
+        LOGE("rename %s to %s error", tmpName.c_str(), fileName);
+        bRet = -1;
+    }
+    if(bRet) {
+        unlink(tmpName.c_str());
+    }
+    return bRet;
+}
+/* an output that is one of the inputs would destroy it, whatever name it goes by */
+static bool sameFile(const char* fileName, const struct stat* input)
+{
+    struct stat sbuf;
+    return stat(fileName, &sbuf) == 0 && sbuf.st_dev == input->st_dev && sbuf.st_ino == input->st_ino;
+}
+static void usage(void)
+{
+    printf("stm32_hexpatch [-d dir] [TEMPLATE HEX] [PATCH FILE]\n");
+    printf("    write one image per device: the template with the bytes of the patch file put in,\n");
+    printf("    only the records a patch touches are encoded again, everything else is copied\n");
+    printf("    -d dir    directory for the output files (default current)\n");
+    printf("    PATCH FILE is CSV, a header \"file,ADDRESS,...\" and a row \"OUTPUT,HEXBYTES,...\" per device,\n");
+    printf("    or NDJSON, an object {\"file\":\"OUTPUT\",\"ADDRESS\":\"HEXBYTES\",...} per line\n");
+}
+int main(int argc, char** argv)
+{
+    patch_template_t t;
+    std::vector<device_t> devices;
+    std::vector<patch_edit_t> edits;
+    std::string dir;
+    uint32_t failed = 0;
+    uint64_t patchedRecords = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "d:")) != -1) {
+        switch(opt) {
+            case 'd':
+                dir = optarg;
+                if(!dir.empty() && dir[dir.size() - 1] != '/') {
+                    dir += '/';
+                }
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if(argc - optind < 2) {
+        usage();
+        return -1;
+    }
+    const char* templateFile = argv[optind + 0];
+    const char* patchFile = argv[optind + 1];
+    struct stat templateStat, patchStat;
+    LOGD("template:%s, patches:%s", templateFile, patchFile);
+    if(loadTemplate(&t, templateFile) || loadPatches(patchFile, &devices)) {
+        return -1;
+    }
+    if(stat(templateFile, &templateStat) < 0 || stat(patchFile, &patchStat) < 0) {
+        LOGE("stat %s or %s error", templateFile, patchFile);
+        return -1;
+    }
+    LOGD("%u data records in the template, %u devices", (uint32_t)t.records.size(), (uint32_t)devices.size());
+    for(uint32_t i = 0; i < devices.size(); i++) {
+        std::string fileName = dir + devices[i].fileName;
+        if(sameFile(fileName.c_str(), &templateStat) || sameFile(fileName.c_str(), &patchStat)) {
+            LOGE("line %u: output %s is an input file, not written", devices[i].line, fileName.c_str());
+            failed++;
+            continue;
+        }
+        if(editRecords(&t, &devices[i], &edits)) {
+            LOGE("line %u: %s not written", devices[i].line, fileName.c_str());
+            failed++;
+            continue;
+        }
+        if(writeImage(&t, &edits, fileName.c_str())) {
+            LOGE("line %u: %s not written", devices[i].line, fileName.c_str());
+            failed++;
+            continue;
+        }
+        patchedRecords += edits.size();
+    }
+    LOGD("%u images written, %llu records encoded again, %u failed", (uint32_t)devices.size() - failed,
+        (unsigned long long)patchedRecords, failed);
+    return failed ? -1 : 0;
+}
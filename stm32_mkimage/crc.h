@@ -3,8 +3,21 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 uint32_t crc32(uint32_t, const unsigned char *, unsigned int);
+/* crc32 hashed in chunk_sz pieces across the cpus and combined */
 uint32_t crc32_wd(uint32_t, const unsigned char *, unsigned int, unsigned int);
+/* crc of A followed by B from crc(A), crc(B) and the length of B */
+uint32_t crc32_combine(uint32_t, uint32_t, unsigned int);
 uint32_t crc32_no_comp(uint32_t, const unsigned char *, unsigned int);
+/* table, slice16, pclmul or vpclmul, chosen for the cpu at startup */
+const char *crc32_engine_name(void);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* __STM32_IBOOT_CRC_H__ */
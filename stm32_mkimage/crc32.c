@@ -1,7 +1,19 @@
 #include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <asm/byteorder.h>
 #include "crc.h"
 
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_SLICE16
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_CLMUL
+#endif
+#endif
+
 #define tole(x) __cpu_to_le32(x)
 /* ========================================================================
 * Table of CRC-32's of all single-byte values (made by make_crc_table)
@@ -74,7 +86,7 @@ static const uint32_t crc_table[256] = {
 };
 
 #define DO_CRC(x) crc = tab[(crc ^ (x)) & 255] ^ (crc >> 8)
-uint32_t crc32_no_comp(uint32_t crc, const unsigned char* buf, unsigned int len)
+static uint32_t crc32_table(uint32_t crc, const unsigned char* buf, unsigned int len)
 {
     const uint32_t *tab = crc_table;
     const uint32_t *b =(const uint32_t *)buf;
@@ -111,13 +123,372 @@ uint32_t crc32_no_comp(uint32_t crc, const unsigned char* buf, unsigned int len)
     return tole(crc);
 }
 
+#ifdef CRC32_SLICE16
+/*
+ * slice-by-16: crc_slice[k][b] is the crc of byte b followed by k zero
+ * bytes, so 16 bytes take 16 independent lookups instead of a chain of
+ * 16 dependent ones. built from crc_table when the engine is selected.
+ */
+static uint32_t crc_slice[16][256];
+
+static void crc32_slice16_init(void)
+{
+    int i, k;
+    for (i = 0; i < 256; i++) {
+        crc_slice[0][i] = crc_table[i];
+        for (k = 1; k < 16; k++)
+            crc_slice[k][i] = (crc_slice[k - 1][i] >> 8) ^ crc_table[crc_slice[k - 1][i] & 255];
+    }
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char* buf, unsigned int len)
+{
+    const uint32_t *tab = crc_table;
+    uint32_t w[4];
+    while (len >= 16) {
+        memcpy(w, buf, 16);
+        w[0] ^= crc;
+        crc = crc_slice[15][w[0] & 255] ^ crc_slice[14][(w[0] >> 8) & 255] ^
+              crc_slice[13][(w[0] >> 16) & 255] ^ crc_slice[12][w[0] >> 24] ^
+              crc_slice[11][w[1] & 255] ^ crc_slice[10][(w[1] >> 8) & 255] ^
+              crc_slice[9][(w[1] >> 16) & 255] ^ crc_slice[8][w[1] >> 24] ^
+              crc_slice[7][w[2] & 255] ^ crc_slice[6][(w[2] >> 8) & 255] ^
+              crc_slice[5][(w[2] >> 16) & 255] ^ crc_slice[4][w[2] >> 24] ^
+              crc_slice[3][w[3] & 255] ^ crc_slice[2][(w[3] >> 8) & 255] ^
+              crc_slice[1][(w[3] >> 16) & 255] ^ crc_slice[0][w[3] >> 24];
+        buf += 16;
+        len -= 16;
+    }
+    while (len--)
+        DO_CRC(*buf++);
+    return crc;
+}
+#endif
+
+#ifdef CRC32_CLMUL
+/*
+ * carry-less multiply folding, "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" (Intel), bit-reflected
+ * constants: k1/k2 fold 4 x 128 bits by 512 bits, k3/k4 by 128 bits,
+ * k5 folds 96 to 64 bits before the Barrett reduction by poly (P(x) and
+ * its quotient). k6/k7 fold by 2048 bits for the 4 x 512 bit loop.
+ */
+static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) = { 0x154442bd4ULL, 0x1c6e41596ULL };
+static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) = { 0x1751997d0ULL, 0x0ccaa009eULL };
+static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) = { 0x163cd6124ULL, 0x000000000ULL };
+static const uint64_t crc_poly[2] __attribute__((aligned(16))) = { 0x1db710641ULL, 0x1f7011641ULL };
+static const uint64_t crc_k6k7[2] __attribute__((aligned(16))) = { 0x11542778aULL, 0x1322d1430ULL };
+
+#define CRC32_CLMUL_MIN     64
+#define CRC32_VPCLMUL_MIN   256
+
+/*
+ * x1..x4 hold the folded state of the data before buf: fold them into
+ * 128 bits, fold the remaining whole 16-byte blocks in, reduce to 32
+ * bits and finish the tail below 16 bytes with the tables.
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_clmul_finish(__m128i x1, __m128i x2, __m128i x3, __m128i x4,
+    const unsigned char* buf, unsigned int len)
+{
+    __m128i x0, x5;
+    uint32_t crc;
+
+    x0 = _mm_load_si128((const __m128i *)crc_k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)crc_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = _mm_extract_epi32(x1, 1);
+
+    return crc32_slice16(crc, buf, len);
+}
+
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_clmul(uint32_t crc, const unsigned char* buf, unsigned int len)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    if (len < CRC32_CLMUL_MIN)
+        return crc32_slice16(crc, buf, len);
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + 0x00)), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x0 = _mm_load_si128((const __m128i *)crc_k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* four independent folds of 128 bits by 512 bits */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+    return crc32_clmul_finish(x1, x2, x3, x4, buf, len);
+}
+
+/* a = a * k folded by the distance of k, plus b: one 512-bit fold step */
+#define CRC32_FOLD512(a, k, b) \
+    _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(a, k, 0x00), _mm512_clmulepi64_epi128(a, k, 0x11), b, 0x96)
+
+/*
+ * the same folding 512 bits per instruction: four zmm registers fold by
+ * 2048 bits, then into one, which folds 64 bytes at a time. its four
+ * 128-bit lanes are then the x1..x4 of the 128-bit loop.
+ */
+__attribute__((target("avx512f,vpclmulqdq,sse4.1,pclmul")))
+static uint32_t crc32_vpclmul(uint32_t crc, const unsigned char* buf, unsigned int len)
+{
+    __m512i z0, z1, z2, z3, k;
+
+    if (len < CRC32_VPCLMUL_MIN)
+        return crc32_clmul(crc, buf, len);
+
+    z0 = _mm512_xor_si512(_mm512_loadu_si512(buf + 0x00), _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+    z1 = _mm512_loadu_si512(buf + 0x40);
+    z2 = _mm512_loadu_si512(buf + 0x80);
+    z3 = _mm512_loadu_si512(buf + 0xc0);
+    buf += 256;
+    len -= 256;
+
+    k = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)crc_k6k7));
+    while (len >= 256) {
+        z0 = CRC32_FOLD512(z0, k, _mm512_loadu_si512(buf + 0x00));
+        z1 = CRC32_FOLD512(z1, k, _mm512_loadu_si512(buf + 0x40));
+        z2 = CRC32_FOLD512(z2, k, _mm512_loadu_si512(buf + 0x80));
+        z3 = CRC32_FOLD512(z3, k, _mm512_loadu_si512(buf + 0xc0));
+        buf += 256;
+        len -= 256;
+    }
+
+    k = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)crc_k1k2));
+    z1 = CRC32_FOLD512(z0, k, z1);
+    z2 = CRC32_FOLD512(z1, k, z2);
+    z0 = CRC32_FOLD512(z2, k, z3);
+    while (len >= 64) {
+        z0 = CRC32_FOLD512(z0, k, _mm512_loadu_si512(buf));
+        buf += 64;
+        len -= 64;
+    }
+    return crc32_clmul_finish(_mm512_extracti32x4_epi32(z0, 0), _mm512_extracti32x4_epi32(z0, 1),
+        _mm512_extracti32x4_epi32(z0, 2), _mm512_extracti32x4_epi32(z0, 3), buf, len);
+}
+#endif
+
+typedef uint32_t (*crc32_engine_t)(uint32_t, const unsigned char *, unsigned int);
+
+static crc32_engine_t crc32_engine = crc32_table;
+static const char *crc32_engine_label = "table";
+
+/*
+ * pick the fastest engine the cpu supports before main() runs, so the
+ * threads hashing in parallel never race on it. CRC32_ENGINE=table|
+ * slice16|pclmul|vpclmul in the environment caps the choice.
+ */
+__attribute__((constructor))
+static void crc32_select_engine(void)
+{
+#ifdef CRC32_SLICE16
+    const char *limit = getenv("CRC32_ENGINE");
+    if (limit && !strcmp(limit, "table"))
+        return;
+    crc32_slice16_init();
+    crc32_engine = crc32_slice16;
+    crc32_engine_label = "slice16";
+    if (limit && !strcmp(limit, "slice16"))
+        return;
+#ifdef CRC32_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("pclmul")) {
+        crc32_engine = crc32_clmul;
+        crc32_engine_label = "pclmul";
+    }
+    if (limit && !strcmp(limit, "pclmul"))
+        return;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq") &&
+        crc32_engine == crc32_clmul) {
+        crc32_engine = crc32_vpclmul;
+        crc32_engine_label = "vpclmul";
+    }
+#endif
+#endif
+}
+
+const char *crc32_engine_name(void)
+{
+    return crc32_engine_label;
+}
+
+uint32_t crc32_no_comp(uint32_t crc, const unsigned char* buf, unsigned int len)
+{
+    return crc32_engine(crc, buf, len);
+}
+
 uint32_t crc32(uint32_t crc, const unsigned char* p, unsigned int len)
 {
     return crc32_no_comp(crc ^ 0xffffffffL, p, len) ^ 0xffffffffL;
 }
 
+/*
+ * crc32_combine: multiplication modulo the reflected polynomial, with
+ * x2n_table[n] = x^(2^n) mod P, so shifting a crc over len2 zero bytes
+ * costs one multiplication per set bit of 8 * len2 (as in zlib).
+ */
+#define CRC32_POLY_REFLECTED    0xedb88320
+
+static uint32_t x2n_table[32];
+
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY_REFLECTED : b >> 1;
+    }
+    return p;
+}
+
+__attribute__((constructor))
+static void crc32_combine_init(void)
+{
+    uint32_t p = (uint32_t)1 << 30;    /* x^1 */
+    int n;
+    x2n_table[0] = p;
+    for (n = 1; n < 32; n++)
+        x2n_table[n] = p = crc32_multmodp(p, p);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, unsigned int len2)
+{
+    uint64_t n = (uint64_t)len2 << 3;
+    uint32_t p = (uint32_t)1 << 31;    /* x^0 */
+    int k = 0;
+    while (n) {
+        if (n & 1)
+            p = crc32_multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return crc32_multmodp(p, crc1) ^ crc2;
+}
+
+/*
+ * crc32_wd: the buffer is cut into chunk_sz pieces, worker threads take
+ * the next piece from a shared counter and hash it on its own, the
+ * calling thread works along. the piece crcs are then combined in order.
+ */
+#define CRC32_WD_MIN_CHUNK      (4 * 1024)
+#define CRC32_WD_MAX_THREADS    64
+
+struct crc32_wd_job {
+    const unsigned char *buf;
+    unsigned int len;
+    unsigned int chunk_sz;
+    unsigned int chunks;
+    unsigned int next;
+    uint32_t *crcs;
+};
+
+static void *crc32_wd_worker(void *arg)
+{
+    struct crc32_wd_job *job = (struct crc32_wd_job *)arg;
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->chunks) {
+        unsigned int off = i * job->chunk_sz;
+        unsigned int n = job->len - off < job->chunk_sz ? job->len - off : job->chunk_sz;
+        job->crcs[i] = crc32(0, job->buf + off, n);
+    }
+    return NULL;
+}
+
 uint32_t crc32_wd(uint32_t crc, const unsigned char* buf, unsigned int len, unsigned int chunk_sz)
 {
-    crc = crc32 (crc, buf, len);
+    pthread_t threads[CRC32_WD_MAX_THREADS];
+    struct crc32_wd_job job;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nthreads, started = 0, i;
+
+    if (chunk_sz < CRC32_WD_MIN_CHUNK)
+        chunk_sz = CRC32_WD_MIN_CHUNK;
+    job.chunks = len / chunk_sz + (len % chunk_sz != 0);
+    nthreads = cpus > CRC32_WD_MAX_THREADS ? CRC32_WD_MAX_THREADS : (cpus > 0 ? cpus : 1);
+    if (nthreads > job.chunks)
+        nthreads = job.chunks;
+    if (nthreads < 2)
+        return crc32(crc, buf, len);
+    job.crcs = (uint32_t *)malloc(job.chunks * sizeof(uint32_t));
+    if (!job.crcs)
+        return crc32(crc, buf, len);
+    job.buf = buf;
+    job.len = len;
+    job.chunk_sz = chunk_sz;
+    job.next = 0;
+
+    /* a thread that can't be started leaves its share to the others */
+    for (i = 0; i + 1 < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, crc32_wd_worker, &job) == 0)
+            started++;
+    }
+    crc32_wd_worker(&job);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < job.chunks; i++) {
+        unsigned int n = i + 1 < job.chunks ? chunk_sz : len - i * chunk_sz;
+        crc = crc32_combine(crc, job.crcs[i], n);
+    }
+    free(job.crcs);
     return crc;
 }
@@ -58,7 +58,7 @@ static int image_verify_header(unsigned char *ptr, int image_size, struct mkimag
     len  = image_size - sizeof(image_header_t) ;
 
     checksum = uimage_to_cpu(hdr->ih_dcrc);
-    if (crc32(0, data, len) != checksum) {
+    if (crc32_wd(0, data, len, CHUNKSZ_CRC32) != checksum) {
         fprintf(stderr,
             "%s: ERROR: \"%s\" has corrupted data!\n",
             params->cmdname, params->imagefile);
@@ -74,10 +74,11 @@ static void image_set_header(void *ptr, struct stat *sbuf, int ifd,
 
     image_header_t * hdr = (image_header_t *)ptr;
 
-    checksum = crc32(0,
+    checksum = crc32_wd(0,
             (const unsigned char *)(ptr +
                 sizeof(image_header_t)),
-            sbuf->st_size - sizeof(image_header_t));
+            sbuf->st_size - sizeof(image_header_t),
+            CHUNKSZ_CRC32);
 
     /* Build new header */
     image_set_magic(hdr, IH_MAGIC);
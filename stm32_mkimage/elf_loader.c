@@ -0,0 +1,166 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "elf_loader.h"
+
+int elf_check_magic (const unsigned char *ptr, size_t size)
+{
+    return size >= SELFMAG && !memcmp(ptr, ELFMAG, SELFMAG);
+}
+
+static int elf_segment_cmp (const void *a, const void *b)
+{
+    const struct elf_segment *sa = (const struct elf_segment *)a;
+    const struct elf_segment *sb = (const struct elf_segment *)b;
+
+    if (sa->paddr != sb->paddr)
+        return sa->paddr < sb->paddr ? -1 : 1;
+    return 0;
+}
+
+/*
+ * read program header idx as 64-bit fields, both classes share the
+ * meaning of every field we need.
+ */
+static int elf_get_phdr (const unsigned char *map, size_t size, int idx,
+                Elf64_Phdr *phdr)
+{
+    if (map[EI_CLASS] == ELFCLASS32) {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr *)map;
+        Elf32_Phdr ph;
+        uint64_t off = eh->e_phoff + (uint64_t)idx * eh->e_phentsize;
+
+        if (eh->e_phentsize < sizeof(ph) || off > size || sizeof(ph) > size - off)
+            return -1;
+        memcpy(&ph, map + off, sizeof(ph));
+        phdr->p_type   = ph.p_type;
+        phdr->p_offset = ph.p_offset;
+        phdr->p_paddr  = ph.p_paddr;
+        phdr->p_filesz = ph.p_filesz;
+    } else {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+        uint64_t off = eh->e_phoff + (uint64_t)idx * eh->e_phentsize;
+
+        /* e_phoff first, the sum cannot wrap once it is inside the file */
+        if (eh->e_phentsize < sizeof(*phdr) || eh->e_phoff > size ||
+            off > size || sizeof(*phdr) > size - off)
+            return -1;
+        memcpy(phdr, map + off, sizeof(*phdr));
+    }
+    return 0;
+}
+
+static int elf_parse (struct elf_image *img)
+{
+    const unsigned char *map = img->map;
+    size_t size = img->map_size;
+    uint64_t entry;
+    int phnum;
+    int i;
+
+    if (map[EI_DATA] != ELFDATA2LSB)
+        return ELF_ERR_FORMAT;
+    if (map[EI_CLASS] == ELFCLASS32 && size >= sizeof(Elf32_Ehdr)) {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr *)map;
+        entry = eh->e_entry;
+        phnum = eh->e_phnum;
+    } else if (map[EI_CLASS] == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+        entry = eh->e_entry;
+        phnum = eh->e_phnum;
+    } else {
+        return ELF_ERR_FORMAT;
+    }
+    if (entry > 0xFFFFFFFFULL)
+        return ELF_ERR_FORMAT;
+    img->entry = entry;
+
+    img->segs = (struct elf_segment *)calloc(phnum ? phnum : 1, sizeof(*img->segs));
+    if (!img->segs)
+        return ELF_ERR_OPEN;
+    img->nsegs = 0;
+    for (i = 0; i < phnum; i++) {
+        Elf64_Phdr ph;
+
+        if (elf_get_phdr(map, size, i, &ph))
+            return ELF_ERR_FORMAT;
+        if (ph.p_type != PT_LOAD || ph.p_filesz == 0)
+            continue;
+        /* written so that a huge offset or size cannot wrap around */
+        if (ph.p_offset > size || ph.p_filesz > size - ph.p_offset ||
+            ph.p_paddr > 0xFFFFFFFFULL || ph.p_filesz > 0x100000000ULL - ph.p_paddr)
+            return ELF_ERR_FORMAT;
+        img->segs[img->nsegs].paddr = ph.p_paddr;
+        img->segs[img->nsegs].size  = ph.p_filesz;
+        img->segs[img->nsegs].data  = map + ph.p_offset;
+        img->nsegs++;
+    }
+    if (img->nsegs == 0)
+        return ELF_ERR_EMPTY;
+
+    qsort(img->segs, img->nsegs, sizeof(*img->segs), elf_segment_cmp);
+    for (i = 1; i < img->nsegs; i++) {
+        const struct elf_segment *prev = &img->segs[i - 1];
+        if ((uint64_t)prev->paddr + prev->size > img->segs[i].paddr)
+            return ELF_ERR_OVERLAP;
+    }
+    return 0;
+}
+
+int elf_load (const char *file, struct elf_image *img)
+{
+    struct stat sbuf;
+    unsigned char *map;
+    int fd;
+    int ret;
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+        return ELF_ERR_OPEN;
+    if (fstat(fd, &sbuf) < 0) {
+        close(fd);
+        return ELF_ERR_OPEN;
+    }
+    if (sbuf.st_size < EI_NIDENT) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return ELF_ERR_OPEN;
+    if (!elf_check_magic(map, sbuf.st_size)) {
+        munmap(map, sbuf.st_size);
+        return 1;
+    }
+
+    memset(img, 0, sizeof(*img));
+    img->map = map;
+    img->map_size = sbuf.st_size;
+    ret = elf_parse(img);
+    if (ret)
+        elf_release(img);
+    return ret;
+}
+
+void elf_release (struct elf_image *img)
+{
+    if (img->map)
+        munmap(img->map, img->map_size);
+    free(img->segs);
+    memset(img, 0, sizeof(*img));
+}
+
+const char *elf_strerror (int err)
+{
+    switch (err) {
+    case ELF_ERR_OPEN:      return "can't open or map the file";
+    case ELF_ERR_FORMAT:    return "unsupported or corrupted ELF file";
+    case ELF_ERR_OVERLAP:   return "overlapping PT_LOAD segments";
+    case ELF_ERR_EMPTY:     return "no loadable segment";
+    default:                return "unknown error";
+    }
+}
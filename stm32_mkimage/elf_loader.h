@@ -0,0 +1,53 @@
+#ifndef __STM32_ELF_LOADER_H__
+#define __STM32_ELF_LOADER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * one PT_LOAD segment at its physical (load) address. only the bytes
+ * present in the file are kept, a .bss tail (p_memsz > p_filesz) is not
+ * part of the image.
+ */
+struct elf_segment {
+    uint32_t paddr;
+    uint32_t size;
+    const unsigned char *data;
+};
+
+/*
+ * a mapped little endian ELF32/ELF64 file, segments point into the
+ * mapping and are sorted by address without overlaps.
+ */
+struct elf_image {
+    unsigned char *map;
+    size_t map_size;
+    uint32_t entry;
+    int nsegs;
+    struct elf_segment *segs;
+};
+
+#define ELF_ERR_OPEN        -1  /* can't open or map the file */
+#define ELF_ERR_FORMAT      -2  /* unsupported or corrupted ELF */
+#define ELF_ERR_OVERLAP     -3  /* two segments load at the same address */
+#define ELF_ERR_EMPTY       -4  /* no PT_LOAD segment with file data */
+
+/* returns 1 if the buffer starts with the ELF magic */
+int elf_check_magic (const unsigned char *ptr, size_t size);
+/*
+ * map file and collect its PT_LOAD segments, returns 0 on success,
+ * 1 if the file is not an ELF (img untouched), ELF_ERR_* otherwise.
+ */
+int elf_load (const char *file, struct elf_image *img);
+void elf_release (struct elf_image *img);
+const char *elf_strerror (int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STM32_ELF_LOADER_H__ */
@@ -1,9 +1,15 @@
 #include "mkimage.h"
 #include "image.h"
+#include "elf_loader.h"
 
 static void copy_file(int, const char *, int);
+static void copy_elf(int, const struct elf_image *);
 static void usage(void);
 
+/* data file when it is an ELF, its segments are laid out from the lowest one */
+static struct elf_image elf_data;
+static int elf_input;
+
 /* image_type_params link list to maintain registered image type supports */
 struct image_type_params *mkimage_tparams = NULL;
 
@@ -175,6 +181,7 @@ main (int argc, char **argv)
                         params.cmdname, *argv);
                     exit (EXIT_FAILURE);
                 }
+                params.aflag = 1;
                 goto NXTARG;
             case 'd':
                 if (--argc <= 0)
@@ -232,6 +239,28 @@ NXTARG:        ;
         if (tparams->check_params (&params))
             usage ();
 
+    /*
+     * an ELF data file brings its own load address and entry point,
+     * -a and -e still take precedence
+     */
+    if (params.dflag) {
+        retval = elf_load (params.datafile, &elf_data);
+        if (retval < 0) {
+            fprintf (stderr, "%s: Can't load %s: %s\n",
+                params.cmdname, params.datafile,
+                elf_strerror (retval));
+            exit (EXIT_FAILURE);
+        }
+        elf_input = (retval == 0);
+        retval = 0;
+        if (elf_input && !params.aflag)
+            params.addr = elf_data.segs[0].paddr;
+        if (elf_input && !params.eflag) {
+            params.ep = elf_data.entry;
+            params.eflag = 1;
+        }
+    }
+
     if (!params.eflag) {
         params.ep = params.addr;
         /* If XIP, entry point must be after the U-Boot header */
@@ -323,7 +352,12 @@ NXTARG:        ;
         exit (EXIT_FAILURE);
     }
 
-    copy_file (ifd, params.datafile, 0);
+    if (elf_input) {
+        copy_elf (ifd, &elf_data);
+        elf_release (&elf_data);
+    } else {
+        copy_file (ifd, params.datafile, 0);
+    }
 
     /* We're a bit of paranoid */
 #if defined(_POSIX_SYNCHRONIZED_IO) && \
@@ -470,6 +504,65 @@ copy_file (int ifd, const char *datafile, int pad)
     (void) close (dfd);
 }
 
+/*
+ * write the ELF segments at their offset from the lowest one, the gaps
+ * are left as holes and read back as zero, as objcopy -O binary would
+ * have filled them.
+ */
+static void
+copy_elf (int ifd, const struct elf_image *elf)
+{
+    struct image_type_params *tparams = mkimage_get_type (params.type);
+    uint32_t base = elf->segs[0].paddr;
+    off_t start = lseek (ifd, 0, SEEK_CUR);
+    uint32_t offset = 0;
+    int i;
+
+    if (params.vflag) {
+        fprintf (stderr, "Adding ELF %s, %d segments, entry 0x%08x\n",
+            params.datafile, elf->nsegs, elf->entry);
+    }
+
+    if (params.xflag) {
+        const struct elf_segment *seg = &elf->segs[0];
+        uint32_t n;
+
+        /* XIP: the reserved space is the start of the first segment */
+        if (seg->size < tparams->header_size) {
+            fprintf (stderr,
+                "%s: Bad size: \"%s\" is too small for XIP\n",
+                params.cmdname, params.datafile);
+            exit (EXIT_FAILURE);
+        }
+        for (n = 0; n < tparams->header_size; n++) {
+            if (seg->data[n] != 0xff) {
+                fprintf (stderr,
+                    "%s: Bad file: \"%s\" has invalid buffer for XIP\n",
+                    params.cmdname, params.datafile);
+                exit (EXIT_FAILURE);
+            }
+        }
+        offset = tparams->header_size;
+    }
+
+    for (i = 0; i < elf->nsegs; i++) {
+        const struct elf_segment *seg = &elf->segs[i];
+        uint32_t skip = i ? 0 : offset;
+        int size = seg->size - skip;
+
+        if (params.vflag) {
+            fprintf (stderr, "    0x%08x - 0x%08x\n",
+                seg->paddr, seg->paddr + seg->size);
+        }
+        if (lseek (ifd, start + (seg->paddr + skip - base - offset), SEEK_SET) < 0 ||
+            write (ifd, seg->data + skip, size) != size) {
+            fprintf (stderr, "%s: Write error on %s: %s\n",
+                params.cmdname, params.imagefile, strerror(errno));
+            exit (EXIT_FAILURE);
+        }
+    }
+}
+
 void
 usage ()
 {
@@ -486,6 +579,8 @@ usage ()
              "          -e ==> set entry point to 'ep' (hex)\n"
              "          -n ==> set image name to 'name'\n"
              "          -d ==> use image data from 'datafile'\n"
+             "                 (an ELF gives its PT_LOAD segments, load address\n"
+             "                 and entry point unless -a/-e are set)\n"
              "          -x ==> set XIP (execute in place)\n",
         params.cmdname);
     exit (EXIT_FAILURE);
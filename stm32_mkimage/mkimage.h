@@ -30,6 +30,7 @@
  * functions
  */
 struct mkimage_params {
+    int aflag;
     int dflag;
     int eflag;
     int fflag;